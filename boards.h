@@ -0,0 +1,63 @@
+#ifndef _BOARDS_H_
+#define _BOARDS_H_
+
+/*
+Adapter board pin profiles.
+Select with BOOK_KBD_BOARD in CMake or BOARD in book_kbd.c
+
+Output data lines are driven by PIO with one "out pins, 8",
+so they must be 8 consecutive pins from BOARD_OUT_BASE.
+Input lines are listed bit 0 first and read with one gpio_get_all(),
+consecutive pins are gathered as one run, see in_runs_init().
+Pin number must not be below its bit number.
+*/
+
+#define BOARD_REV1   0  //Original adapter
+#define BOARD_REV2   1  //Inputs moved to one run, 11-18
+
+#ifndef BOARD
+#define BOARD BOARD_REV1
+#endif
+
+//Consecutive input pins: pin mask and shift down to their place in the code
+typedef struct {
+  uint32_t mask;
+  uint8_t  shift;
+} pin_run_t;
+
+#if BOARD == BOARD_REV1
+
+#define BOARD_NAME     "Rev1"
+//Output 2-9, INT 10
+#define BOARD_OUT_BASE 2
+#define BOARD_INT_PIN  10
+//Built-in keyboard 11,12,13,14,15,26,27,28
+#define BOARD_IN_PINS  {11,12,13,14,15,26,27,28}
+//Port 60h read strobe, active low, not INTA - it comes before the port is read
+#define BOARD_ACK_PIN  17
+//USB keyboard mounted
+#define BOARD_LED_PIN  16
+//XT or AT keyboard CLK, DATA is next pin
+#define BOARD_XT_CLK_PIN 20
+//Turbo switch
+#define BOARD_TURBO_PIN 18
+//Reset or NMI
+#define BOARD_RESET_PIN 19
+
+#elif BOARD == BOARD_REV2
+
+#define BOARD_NAME     "Rev2"
+#define BOARD_OUT_BASE 2
+#define BOARD_INT_PIN  10
+#define BOARD_IN_PINS  {11,12,13,14,15,16,17,18}
+#define BOARD_ACK_PIN  19
+#define BOARD_LED_PIN  22
+#define BOARD_XT_CLK_PIN 20
+#define BOARD_TURBO_PIN 26
+#define BOARD_RESET_PIN 27
+
+#else
+#error Unknown BOARD, see boards.h
+#endif
+
+#endif
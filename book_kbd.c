@@ -9,8 +9,24 @@ GPLv3
 
 //#define  DEBUG
 
+//Output backend, normally set with BOOK_KBD_OUTPUT in CMake, see output.h
+//OUT_BUS - Book8088 bus, OUT_BUS_ACK - drop INT as soon as Book reads the code, see ack_pin
+//OUT_XT - real IBM PC/XT keyboard, OUT_PS2 - AT/PS2 keyboard, see xt_clk_pin
+//OUT_SIM - no bus, for benchmarks
+//#define  OUTPUT OUT_XT
+
+//Adapter pinout, normally set with BOOK_KBD_BOARD in CMake, see boards.h
+//#define  BOARD BOARD_REV2
+
+//Log INT edges of our own bus on spare SM, RCtrl+RAlt+C prints them
+//Output is in BookKbdLog.txt format, followed by comparison with timing profile
+//#define  BUS_CAPTURE
+
+//Start in deterministic mode, RCtrl+RAlt+D toggles it, see det_mode
+//#define  DETERMINISTIC
+
 #ifdef DEBUG
-# define dprint(x) printf x
+# define dprint(x) do { if (!det_mode) printf x; } while (0)
 #else
 # define dprint(x) do {} while (0)
 #endif
@@ -22,66 +38,383 @@ GPLv3
 #include "bsp/board.h"
 #include "tusb.h"
 
+#include "pico/time.h"
+#include "pico/stdio.h"
+#include "pico/multicore.h"
 #include "hardware/gpio.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/structs/usb.h"
 
 #include "xt.h"
+#include "boards.h"
+#include "timing.h"
+#include "output.h"
+#include "key_queue.h"
+#include "stats.h"
+#include "sched.h"
+#include "key_map.h"
+#include "kbd_bus.pio.h"
+#include "xt_serial.pio.h"
+#include "ps2_dev.pio.h"
+#include "bus_capture.pio.h"
+
+#if defined(BUS_CAPTURE) && OUTPUT != OUT_BUS && OUTPUT != OUT_BUS_ACK
+#error BUS_CAPTURE is for Book8088 bus only
+#endif
+
+//Pins come from board profile, see boards.h
+//Output pins are driven by PIO and must be consecutive
+const uint8_t kbd_out_base = BOARD_OUT_BASE;
+const uint8_t kbd_in_pins[8] = BOARD_IN_PINS;
+//Input sample is gathered from these, built from kbd_in_pins
+pin_run_t kbd_in_runs[8];
+uint kbd_in_run_count = 0;
+const uint8_t int_pin = BOARD_INT_PIN;
+//Port 60h read strobe, active low, not INTA - it comes before the port is read
+const uint8_t ack_pin = BOARD_ACK_PIN;
+//XT or AT keyboard CLK, DATA is next pin
+const uint8_t xt_clk_pin = BOARD_XT_CLK_PIN;
+//USB keyboard mounted
+const uint8_t led_pin = BOARD_LED_PIN;
+//Book8088 CPU speed, see TURBO_KEY
+const uint8_t turbo_pin = BOARD_TURBO_PIN;
+//Book8088 reset or NMI, see RESET_KEY
+const uint8_t reset_pin = BOARD_RESET_PIN;
+
+//Hotkeys: RCtrl+RAlt + key
+#define HOTKEY_MODS 0x50
+volatile uint8_t kbd_conn = 0;
 
-uint8_t  kbd_out_pins[8] = {2,3,4,5,6,7,8,9};
-uint8_t  kbd_in_pins[8] = {11,12,13,14,15,26,27,28};
-uint8_t  int_pin = 10;
-uint8_t  kbd_conn = 0;
+//For setting leds
+uint8_t kbd_addr;
+uint8_t kbd_inst;
+//Lock leds in HID order: 0 - Num, 1 - Caps, 2 - Scroll
+uint8_t kbd_leds = 0;
+
+//Turbo: TURBO_KEY with TURBO_MODS held toggles turbo_pin, key itself is not sent
+//Level on turbo_pin, or TURBO_PULSE_US pulse for toggle-type turbo inputs
+#define TURBO_KEY 0x45  //F12
+#define TURBO_MODS 0x00
+#define TURBO_PULSE_US 0
+//Toggle blinks all lock leds, twice - turbo on, once - off, then they are back to kbd_leds
+#define TURBO_BLINK_US 150000
+//Turbo may also be shown steady on a led lock keys don't use: 0x08 - Compose, 0x10 - Kana
+//Most keyboards have only Num, Caps and Scroll, so it is off by default
+#define TURBO_LED 0x00
+bool turbo_on = false;
+//Blink phases left, leds are lit on even ones
+volatile uint8_t turbo_blink = 0;
+
+//Hard reset: RESET_KEY with RESET_MODS held pulses reset_pin for RESET_PULSE_US
+//Works when Book is hung with interrupts off, nothing goes to fifo
+#define RESET_KEY 0x4C  //Delete
+#define RESET_MODS HOTKEY_MODS
+#define RESET_PULSE_US 50000
+//1 - pulled low like a reset button, 0 - driven high, e.g. for NMI
+#define RESET_ACTIVE_LOW 1
+
+//Deterministic mode: optional work waits so key latency has a bound
+//No debug output, no led reports to USB keyboard, no UART paste streams
+#ifdef DETERMINISTIC
+volatile bool det_mode = true;
+#else
+volatile bool det_mode = false;
+#endif
+
+//Pipeline stages, each is checked against its budget in every mode
+#define DL_REPORT  0  //USB IRQ to report_task
+#define DL_PROCESS 1  //process_kbd_report
+#define DL_QUEUE   2  //key queued to picked by main_cycle
+#define DL_EMIT    3  //picked by main_cycle to its INT rise, see out_edge
+#define DL_STAGES  4
+
+typedef struct {
+  const char *name;
+  uint32_t budget_us;
+  //Each stage is timed on one core only, pace_report reads it from core1
+  stat_t stat;
+} deadline_t;
+
+deadline_t deadlines[DL_STAGES] = {
+  {.name = "USB IRQ to report", .budget_us = 250},
+  {.name = "report processing", .budget_us = 100},
+  {.name = "queue to output",   .budget_us = 2000},
+  //Budget follows timing profile, set_timing
+  {.name = "pick to INT rise"},
+};
+
+static inline void deadline_check(uint stage, uint32_t us) {
+  deadline_t *d = &deadlines[stage];
+  stat_note(&d->stat, us, us > d->budget_us);
+}
+
+//Cores:
+//core0 - output alarms and PIO, typematic, built-in keyboard, UART paste, backend tasks
+//core1 - TinyUSB host and report processing
+//core1 hands keys and commands to core0 through SIO FIFO, one word per event:
+//bits 8-15 - event, bits 0-7 - argument
+#define EV_KEY    0  //new codes in usb_queue
+#define EV_CLEAR  1  //clear_pins
+#define EV_TIMING 2  //set_timing
+
+//Both cores sleep in WFE until there is work
+//core0 wakeups by source, counted in handlers
+#define WAKE_ALARM  0  //output_alarm
+#define WAKE_SCAN   1  //scan_timer
+#define WAKE_EDGE   2  //built-in keyboard pin change
+#define WAKE_DMA    3  //bulk chunk done
+#define WAKE_CORE1  4  //events from core1
+#define WAKE_UART   5  //console input
+#define WAKE_SOURCES 6
+//Only grow, wake_report prints what changed
+volatile uint32_t wake_count[WAKE_SOURCES];
+//Times each core left WFE
+volatile uint32_t core_wakes[2];
+
+//core1 only, waits if core0 is 8 events behind
+void post_event(uint8_t ev, uint8_t arg) {
+  multicore_fifo_push_blocking(((uint32_t)ev << 8) | arg);
+}
+
+//usb_queue holds the codes, one EV_KEY in flight is enough to wake core0
+//Set by core1 when it posts, cleared by core0 before it looks at the queue
+volatile bool key_event_posted = false;
+
+void post_key_event(void) {
+  if (key_event_posted) return;
+  key_event_posted = true;
+  post_event(EV_KEY, 0);
+}
+
+//TinyUSB lives on core1, any core may ask for a led update
+volatile bool leds_pending = false;
+
+void update_leds(void) {
+  leds_pending = true;
+  __sev();
+}
+
+//core1
+void leds_task(void) {
+  //Report is sent after we return
+  static uint8_t leds;
+  //Sent when deterministic mode is off again
+  if (!leds_pending || det_mode) return;
+  leds_pending = false;
+  if (turbo_blink) leds = (turbo_blink & 1) ? 0 : 0x07;
+  else leds = kbd_leds | (turbo_on ? TURBO_LED : 0);
+  if (kbd_conn) tuh_hid_set_report(kbd_addr,kbd_inst,0,HID_REPORT_TYPE_OUTPUT,&leds,1);
+}
+
+//Raw keyboard reports, callback only copies them here and re-arms the endpoint
+//Callback and report_task both run from core1 main loop, no locking needed
+#define REPORT_RING 8
+
+typedef struct {
+  uint8_t dev_addr;
+  uint8_t instance;
+  //USB frame number and time of its IRQ, see usb_irq_stamp
+  uint16_t frame;
+  uint32_t arrival_us;
+  hid_keyboard_report_t report;
+} kbd_report_t;
+
+kbd_report_t report_ring[REPORT_RING];
+volatile uint8_t report_head = 0;
+volatile uint8_t report_tail = 0;
+//Ring was full, newest report replaced the last one queued
+uint32_t report_merged = 0;
+
+//USB IRQ to report processing, bucket i is under 32<<i us, last one is the rest
+#define USB_DELAY_BUCKETS 8
+uint32_t usb_delay_hist[USB_DELAY_BUCKETS];
+uint32_t usb_delay_max = 0;
+//Processed in a later USB frame than its IRQ came
+uint32_t usb_frame_slips = 0;
+//Time and USB frame of the first USB IRQ since last usb_task
+volatile uint32_t usb_irq_us;
+volatile uint16_t usb_irq_frame;
+volatile bool usb_irq_pending = false;
+//What reports of current tuh_task pass got, never later than their IRQ
+uint32_t usb_pass_us;
+uint16_t usb_pass_frame;
+
+//All bus timings live in timing.h
+const timing_profile_t * volatile timing = &timing_profiles[TIMING_PROFILE];
 
 //microseconds
-//This defines microseconds delay for scanning keyboard or precessing USB input
-//defaul value for Book was 6000
-//4000us = 4ms = 250 scans per second
-//But we send keys from buffer at 1/10 rate for Book to process them correctly.
-const uint64_t KBD_CYCLE = 4000;
-const uint64_t FIRST_DELAY_CYCLES = 15;
-const uint64_t NEXT_DELAY_CYCLES = 2;
+//Delay before sending first byte if output was idle
+const uint64_t KBD_WAKE = 20;
+
+PIO  kbd_pio = pio0;
+uint kbd_sm;
+uint kbd_offset;
 
-uint64_t rep_counter = 0;
+absolute_time_t rep_time;
+//Typematic delay and rate, from profile or set by AT host
+volatile uint32_t rep_first_us;
+volatile uint32_t rep_next_us;
 
 uint8_t last_key = 0;
 uint8_t repeat_key = 0;
+//Record of last_key press, repeats go out with its source and stamp
+key_event_t last_ev;
+//Typematic repeats are only made when fifo is empty, so they never wait in it
+//Repeats that fell due under backlog and queued makes of the held key are collapsed
+//core0 only, they only grow, pace_report prints what changed
+uint32_t rep_collapsed = 0;
+uint32_t rep_dups = 0;
 
 uint8_t local_key = 0;
 
 static void send_key(uint8_t code);
+void send_code(uint8_t code);
+void clear_pins(void);
+void get_input(void);
+static void process_kbd_report(hid_keyboard_report_t const *report);
+void report_task(void);
+void set_timing(uint8_t profile);
+void pace_report(void);
+void det_toggle(void);
+void turbo_init(void);
+void reset_init(void);
 
 uint8_t non_rep[] = {0x3A, 0x54, 0x46, 0x45, 0x1D, 0x38, 0x2A, 0x36};
 
-uint8_t fifo[17];
-uint8_t fifo_count = 0;
+//Scancode queues, one per producer, see key_queue.h
+//USB keys are put by core1, built-in keyboard by core0 timer IRQs
+key_queue_t usb_queue = {.name = "USB"};
+key_queue_t local_queue = {.name = "Built-in"};
+key_queue_t * const queues[] = {&usb_queue, &local_queue};
+#define QUEUES (sizeof(queues)/sizeof(queues[0]))
+
+//Output pacing, gap between bytes goes from timing->gap_us down to pace_floor under backlog
+volatile uint32_t pace_gap;
+volatile uint32_t pace_floor;
+//How long last byte waited in fifo, worst one is DL_QUEUE
+uint32_t pace_wait = 0;
+
+//Output is driven by alarm, 0 when idle
+volatile alarm_id_t out_alarm = 0;
+absolute_time_t next_frame;
+//When out_alarm fires next, it may be parked until repeat is due
+absolute_time_t out_alarm_due;
+
+static void wake_output(void);
+
+//Bulk stream, per code timing, 0 - use profile and pacing
+typedef struct {
+  uint8_t  code;
+  uint16_t pulse_us;
+  uint16_t gap_us;
+} bulk_code_t;
+
+//Codes per DMA transfer, interactive keys can only go in between
+#define BULK_CHUNK 4
+#define BULK_MAX 1024
+//Pasted text, 4 codes per char at most
+#define PASTE_MAX (BULK_MAX/4)
+#define PASTE_IDLE_US 20000
+
+bulk_code_t bulk_codes[BULK_MAX];
+uint32_t bulk_words[BULK_CHUNK*3];
+volatile uint16_t bulk_len = 0;
+volatile uint16_t bulk_pos = 0;
+volatile bool bulk_busy = false;
+int bulk_dma;
+
+uint32_t bulk_stat_start, bulk_stat_expect, bulk_stat_took;
+uint16_t bulk_stat_count;
+//Set by bulk_drain_poll once the stream is out, bulk_check prints it
+volatile bool bulk_report = false;
+
+static bool bulk_next(void);
+int64_t bulk_drain_poll(alarm_id_t id, void *user_data);
+
+uint16_t fifo_count(void) {
+  uint16_t n = 0;
+  for (uint i=0; i<QUEUES; i++) n += kq_count(queues[i]);
+  return n;
+}
 
-void fifo_put(uint8_t code) {
-  if (fifo_count<16) {
-      fifo[fifo_count++] = code;
-  } else {
-      printf("Buffer full!\r\n");  
-  }  
+//core0, queue is not locked, but wake_output must run with interrupts off
+void fifo_wake(void) {
+  uint32_t irq = save_and_disable_interrupts();
+  wake_output();
+  restore_interrupts(irq);
 }
 
-uint8_t fifo_get() {
-  uint8_t code;
-  if (fifo_count>0) {
-      code = fifo[0];
-      fifo_count--;
-      for (uint8_t i=0; i<fifo_count; i++) fifo[i]=fifo[i+1];
-  } else code = last_key;
-  return code;
+uint8_t key_flags(uint8_t code) {
+  code &= 0x7F;
+  return (code==CTRL || code==ALT || code==SHIFTL || code==SHIFTR) ? KEV_MOD : 0;
+}
+
+//Only the producer of q may call it, full queue counts a drop
+void fifo_put(key_queue_t *q, key_event_t e) {
+  if (!out_enabled()) return;
+  if (kq_put(q, e)) fifo_wake();
+}
+
+//Consumer, output alarm only
+//Oldest event first, whichever queue it is in
+//Nothing queued - last key record, main_cycle decides on repeat
+key_event_t fifo_get() {
+  key_queue_t *q;
+  key_event_t e;
+
+  while (true) {
+    q = NULL;
+    for (uint i=0; i<QUEUES; i++) {
+      if (!kq_count(queues[i])) continue;
+      if (!q || kev_before(kq_peek(queues[i]), kq_peek(q))) q = queues[i];
+    }
+    if (!q) {
+        pace_wait = 0;
+        e = last_ev;
+        e.code = last_key;
+        return e;
+    }
+    e = kq_peek(q);
+    kq_drop(q);
+    //Make of the key already held would only be taken as a repeat,
+    //skip it so it doesn't take a slot from keys behind it
+    if (last_key && e.code == last_key) {
+      rep_dups++;
+      continue;
+    }
+    pace_wait = kev_age_us(e);
+    deadline_check(DL_QUEUE, pace_wait);
+    return e;
+  }
+}
+
+//Arrival to output, per source, repeats are not counted
+#define LAT_LOCAL  0
+#define LAT_USB    1
+#define LAT_SOURCES 2
+stat_t lat_stats[LAT_SOURCES];
+
+void latency_note(key_event_t e) {
+  if (e.flags & KEV_REPEAT) return;
+  uint i = (e.src >= KEV_SRC_USB) ? LAT_USB : LAT_LOCAL;
+  stat_note(&lat_stats[i], kev_age_us(e), false);
 }
 
 //---------------------------
-uint8_t main_cycle(void) { 
+//Returns event to send, code 0 - nothing
+key_event_t main_cycle(void) { 
+key_event_t ev;
 uint8_t code;
 
   //Do we have something in buffer?
-  code = fifo_get();
-
-  if (!code) return 0;
+  ev = fifo_get();
+  code = ev.code;
+  ev.code = 0;
 
-  if (rep_counter) rep_counter--;
+  if (!code) return ev;
 
   if (code&0x80) {
       if ((code&0x7F)==last_key) {
@@ -89,54 +422,1232 @@ uint8_t code;
           last_key = 0;
       }
       dprint(("REL_%X ",code&0x7F));
-      return code;
+      ev.code = code;
+      return ev;
   } else {
       if (code != last_key) {
           repeat_key = code;
           last_key = code;
+          last_ev = ev;
           for (uint8_t i=0; i<sizeof(non_rep); i++) if (code==non_rep[i]) repeat_key = 0;
           if (repeat_key) { 
               dprint(("FIR_%X ",code));
-              rep_counter = FIRST_DELAY_CYCLES;
+              rep_time = make_timeout_time_us(rep_first_us);
           } else {
               dprint(("NOR_%X ",code));
           }
-          return code;
+          ev.code = code;
+          return ev;
       } else {
-          if (!repeat_key) return 0;
-          if (!rep_counter) {
+          if (!repeat_key) return ev;
+          if (time_reached(rep_time)) {
+              //Repeats missed while backlog went out are sent as one
+              int64_t late = absolute_time_diff_us(rep_time, get_absolute_time());
+              if (rep_next_us && late >= (int64_t)rep_next_us) rep_collapsed += late / rep_next_us;
               dprint(("NER_%X ",code));
-              rep_counter = NEXT_DELAY_CYCLES;
-              return code;
-          } else return 0;
+              rep_time = make_timeout_time_us(rep_next_us);
+              ev.code = code;
+              ev.flags |= KEV_REPEAT;
+              return ev;
+          } else return ev;
       }
   }
 }
 
+//Output edges: INT rise, XT REQOUT or PS/2 byte out, one per OUT_EDGE_WORDS pushed
+//Picked code waits for its own edge, whatever is ahead of it in FIFO and PIO
+//core0 only
+uint32_t out_pushed = 0;
+volatile uint32_t out_edges = 0;
+uint32_t emit_seq, emit_pick;
+volatile bool emit_pending = false;
+
+//Before the code is pushed, pick - when main_cycle took it
+static inline void emit_expect(uint32_t pick) {
+  emit_seq = out_pushed + 1;
+  emit_pick = pick;
+  emit_pending = true;
+}
+
+//Backend IRQ, now - when the edge was seen
+void out_edge(uint32_t now) {
+  out_edges++;
+  if (emit_pending && (int32_t)(out_edges - emit_seq) >= 0) {
+    emit_pending = false;
+    deadline_check(DL_EMIT, now - emit_pick);
+  }
+}
+
+//PIO sets irq 0 rel on the edge, see kbd_bus.pio and xt_serial.pio
+void out_edge_irq(void) {
+  if (!pio_interrupt_get(kbd_pio, kbd_sm)) return;
+  pio_interrupt_clear(kbd_pio, kbd_sm);
+  out_edge(time_us_32());
+}
+
+static inline void out_edge_init(void) {
+  pio_set_irq0_source_enabled(kbd_pio, pis_interrupt0 + kbd_sm, true);
+  irq_set_exclusive_handler(PIO0_IRQ_0, out_edge_irq);
+  irq_set_enabled(PIO0_IRQ_0, true);
+}
+
+static void bulk_stop(void);
+
 void clear_pins(void) {
-  for (int i=0;i<8;i++) gpio_put(kbd_out_pins[i],0);
-  fifo_count = 0;
+  uint32_t irq = save_and_disable_interrupts();
+  bulk_stop();
+  out_reset();
+  //Codes dropped from FIFO will never show an edge
+  out_edges = out_pushed;
+  emit_pending = false;
+  for (uint i=0; i<QUEUES; i++) kq_clear(queues[i]);
   last_key = 0;
+  restore_interrupts(irq);
 } 
 
-void raise_interrupt(uint8_t code) {
-  //Set keyboard pins
-  //2Do - only if key changes
-  for (int i=0;i<8;i++) {
-      (code&1) ? gpio_put(kbd_out_pins[i],1) : gpio_put(kbd_out_pins[i],0);
-      code = code>>1;
-  }  
-  sleep_us(10);
-  gpio_put(int_pin,1);
+//--------------------------------------------------
+//Output backends, see output.h
+//--------------------------------------------------
+
+#if OUTPUT == OUT_BUS || OUTPUT == OUT_BUS_ACK
+
+#if OUTPUT == OUT_BUS_ACK
+#define OUT_NAME "Book8088 bus with ACK"
+#define OUT_CAPS (OUT_CAP_PIO | OUT_CAP_ACK)
+#define OUT_WORDS KBD_BUS_ACK_WORDS
+#else
+#define OUT_NAME "Book8088 bus"
+#define OUT_CAPS OUT_CAP_PIO
+#define OUT_WORDS KBD_BUS_WORDS
+#endif
+//INT rise per code
+#define OUT_EDGE_WORDS OUT_WORDS
+
+//We use 8 pins from kbd_out_base for bits
+//int_pin - to signal interrupt
+static inline void out_init(void) {
+#if OUTPUT == OUT_BUS_ACK
+  gpio_init(ack_pin);
+  gpio_set_dir(ack_pin,GPIO_IN);
+  gpio_pull_up(ack_pin);
+  //PIO waits for high level
+  gpio_set_inover(ack_pin,GPIO_OVERRIDE_INVERT);
+  kbd_offset = pio_add_program(kbd_pio, &kbd_bus_ack_program);
+  kbd_bus_ack_program_init(kbd_pio, kbd_sm, kbd_offset, kbd_out_base, int_pin, ack_pin);
+#else
+  kbd_offset = pio_add_program(kbd_pio, &kbd_bus_program);
+  kbd_bus_program_init(kbd_pio, kbd_sm, kbd_offset, kbd_out_base, int_pin);
+#endif
+  out_edge_init();
 }
 
-void lower_interrupt(void) {
-    gpio_put(int_pin,0);
+static inline uint out_encode(uint32_t *w, uint8_t code, uint32_t pulse_us, uint32_t gap_us) {
+  const timing_profile_t *t = timing;
+#if OUTPUT == OUT_BUS_ACK
+  //Pulse width is ACK timeout here
+  return kbd_bus_ack_encode(w, code, t->setup_us, pulse_us, t->ack_gap_us, gap_us);
+#else
+  return kbd_bus_encode(w, code, t->setup_us, pulse_us, gap_us);
+#endif
 }
 
-void hid_app_task(void);
-void get_input(void);
-static void process_kbd_report(hid_keyboard_report_t const *report);
+static inline void out_reset(void) {
+  kbd_bus_reset(kbd_pio, kbd_sm, kbd_offset, kbd_out_base, int_pin);
+}
+
+static inline int64_t out_frame_us(uint32_t gap_us) {
+  return timing_frame(timing, gap_us);
+}
+
+static inline int64_t out_poll_us(uint32_t gap_us) {
+#if OUTPUT == OUT_BUS_ACK
+  //Byte may be taken much earlier, poll the bus while we have backlog
+  return timing_ack_frame(timing);
+#else
+  return timing_frame(timing, gap_us);
+#endif
+}
+
+//Code picked when FIFO is empty, previous one may have just been taken:
+//its setup, pulse or ACK timeout and gap, then our setup
+static inline uint32_t out_emit_budget_us(void) {
+  return timing_frame(timing, timing->gap_us) + timing->setup_us;
+}
+
+static inline bool out_enabled(void) {
+  return true;
+}
+
+static inline bool out_replies(void) {
+  return false;
+}
+
+//SM stalls on empty FIFO once everything is out
+static inline void out_drain_start(void) {
+  kbd_pio->fdebug = 1u << (PIO_FDEBUG_TXSTALL_LSB + kbd_sm);
+}
+
+static inline bool out_drained(void) {
+  return kbd_pio->fdebug & (1u << (PIO_FDEBUG_TXSTALL_LSB + kbd_sm));
+}
+
+static inline void out_task(void) {
+}
+
+#elif OUTPUT == OUT_XT
+
+#define OUT_NAME "XT keyboard"
+#define OUT_CAPS (OUT_CAP_PIO | OUT_CAP_HOST_PACED)
+#define OUT_WORDS 1
+//REQOUT per code
+#define OUT_EDGE_WORDS 1
+
+//BIOS resets keyboard holding CLK low for 20ms, we answer with AA when it's released
+//Our own CLK low is under 100us
+#define XT_RESET_US 10000
+//CLK falling edge starts polling, it stops once CLK is high again
+#define XT_CLK_POLL_US 1000
+
+void input_edge(uint gpio, uint32_t events);
+
+volatile alarm_id_t xt_clk_alarm = 0;
+
+int64_t xt_clk_poll(alarm_id_t id, void *user_data) {
+  static uint32_t low_since = 0;
+
+  if (!gpio_get(xt_clk_pin)) {
+    if (!low_since) low_since = time_us_32() | 1;
+    return -XT_CLK_POLL_US;
+  }
+  if (low_since && time_us_32() - low_since > XT_RESET_US) {
+    dprint(("XT reset\r\n"));
+    clear_pins();
+    send_code(0xAA);
+  }
+  low_since = 0;
+  xt_clk_alarm = 0;
+  gpio_set_irq_enabled(xt_clk_pin, GPIO_IRQ_EDGE_FALL, true);
+  return 0;
+}
+
+//GPIO IRQ, from input_edge
+//Edges of our own bits are not needed while polling
+void xt_clk_edge(void) {
+  gpio_set_irq_enabled(xt_clk_pin, GPIO_IRQ_EDGE_FALL, false);
+  if (!xt_clk_alarm) xt_clk_alarm = add_alarm_in_us(XT_CLK_POLL_US, xt_clk_poll, NULL, true);
+}
+
+static inline void out_init(void) {
+  kbd_offset = pio_add_program(kbd_pio, &xt_serial_program);
+  xt_serial_program_init(kbd_pio, kbd_sm, kbd_offset, xt_clk_pin);
+  //Callback is shared with built-in keyboard pins
+  gpio_set_irq_enabled_with_callback(xt_clk_pin, GPIO_IRQ_EDGE_FALL, true, input_edge);
+  out_edge_init();
+}
+
+//Bit timing is fixed, host paces us holding DATA low
+static inline uint out_encode(uint32_t *w, uint8_t code, uint32_t pulse_us, uint32_t gap_us) {
+  w[0] = xt_serial_frame(code);
+  return 1;
+}
+
+static inline void out_reset(void) {
+  xt_serial_reset(kbd_pio, kbd_sm, kbd_offset, xt_clk_pin);
+}
+
+static inline int64_t out_frame_us(uint32_t gap_us) {
+  return XT_SERIAL_FRAME_US;
+}
+
+static inline int64_t out_poll_us(uint32_t gap_us) {
+  return XT_SERIAL_FRAME_US;
+}
+
+//Previous frame, then host releases DATA once IRQ1 read it
+static inline uint32_t out_emit_budget_us(void) {
+  return 2 * XT_SERIAL_FRAME_US;
+}
+
+static inline bool out_enabled(void) {
+  return true;
+}
+
+static inline bool out_replies(void) {
+  return false;
+}
+
+//SM stalls on empty FIFO once everything is out
+static inline void out_drain_start(void) {
+  kbd_pio->fdebug = 1u << (PIO_FDEBUG_TXSTALL_LSB + kbd_sm);
+}
+
+static inline bool out_drained(void) {
+  return kbd_pio->fdebug & (1u << (PIO_FDEBUG_TXSTALL_LSB + kbd_sm));
+}
+
+//Host reset is caught by xt_clk_edge
+static inline void out_task(void) {
+}
+
+#elif OUTPUT == OUT_PS2
+
+#define OUT_NAME "AT/PS2 keyboard"
+#define OUT_CAPS (OUT_CAP_PIO | OUT_CAP_HOST_PACED | OUT_CAP_HOST_CMD)
+//Set 2 break is F0 + make
+#define OUT_WORDS 2
+//Sent byte note per byte, replies included
+#define OUT_EDGE_WORDS 1
+
+//Scancode set asked by host, 1 or 2
+uint8_t ps2_set = 2;
+//F5 stops scanning until F4
+volatile bool ps2_scanning = true;
+//Last byte that really went out, for FE
+//Codes are encoded ahead of the wire, so it comes back from PIO
+volatile uint8_t ps2_last = 0;
+
+//Replies to host commands wait here until TX FIFO has room
+//Scancodes hold off while any is waiting, so the host gets its reply first,
+//only codes already in PIO FIFO go ahead of it
+//Host waits for a reply to every byte, F2 is the longest with 3
+#define PS2_TX 8
+
+uint8_t ps2_tx[PS2_TX];
+volatile uint8_t ps2_tx_head = 0;
+volatile uint8_t ps2_tx_tail = 0;
+
+//Never waits, from task, output alarm, DMA and RX IRQs
+//True while replies are still waiting
+bool ps2_tx_push(void) {
+  uint32_t irq = save_and_disable_interrupts();
+  //Don't split F0 + make of a bulk chunk
+  while (ps2_tx_tail != ps2_tx_head && !dma_channel_is_busy(bulk_dma) &&
+         !pio_sm_is_tx_fifo_full(kbd_pio, kbd_sm)) {
+    pio_sm_put(kbd_pio, kbd_sm, ps2_dev_frame(ps2_tx[ps2_tx_tail % PS2_TX]));
+    ps2_tx_tail++;
+    out_pushed++;
+  }
+  bool wait = ps2_tx_tail != ps2_tx_head;
+  restore_interrupts(irq);
+  return wait;
+}
+
+//PIO RX FIFO has host bytes and sent byte notes in wire order
+//IRQ drains it, so neither is lost, each host byte keeps ps2_last of its time
+#define PS2_RX 16
+
+typedef struct {
+  uint32_t w;
+  uint8_t last;
+} ps2_rx_t;
+
+ps2_rx_t ps2_rx[PS2_RX];
+volatile uint8_t ps2_rx_head = 0;
+uint8_t ps2_rx_tail = 0;
+
+void ps2_rx_irq(void) {
+  uint8_t b;
+  while (!pio_sm_is_rx_fifo_empty(kbd_pio, kbd_sm)) {
+    uint32_t w = pio_sm_get(kbd_pio, kbd_sm);
+    if (ps2_dev_sent(w, &b)) {
+      //Our own resend request is not what host may ask again
+      if (b != 0xFE) ps2_last = b;
+      out_edge(time_us_32());
+      //Byte left TX FIFO, next reply may fit
+      ps2_tx_push();
+      continue;
+    }
+    //Host waits for a reply to every byte, can't get this far ahead
+    if ((uint8_t)(ps2_rx_head - ps2_rx_tail) >= PS2_RX) continue;
+    ps2_rx[ps2_rx_head % PS2_RX] = (ps2_rx_t){.w = w, .last = ps2_last};
+    ps2_rx_head++;
+  }
+}
+
+//Host to keyboard commands
+//Replies go ahead of anything not yet in PIO FIFO, see ps2_tx
+void ps2_reply(uint8_t b) {
+  if ((uint8_t)(ps2_tx_head - ps2_tx_tail) >= PS2_TX) return;
+  ps2_tx[ps2_tx_head % PS2_TX] = b;
+  ps2_tx_head++;
+  ps2_tx_push();
+}
+
+void ps2_defaults(void) {
+  rep_first_us = timing->first_us;
+  rep_next_us = timing->next_us;
+  ps2_set = 2;
+}
+
+//last - byte sent before this command came
+void ps2_command(uint8_t b, uint8_t last) {
+  //Command waiting for its argument, argument is always below ED
+  static uint8_t cmd = 0;
+
+  if (cmd && b < 0xED) {
+    switch (cmd) {
+      case 0xED:
+        //AT: 0 - Scroll, 1 - Num, 2 - Caps; HID: 0 - Num, 1 - Caps, 2 - Scroll
+        kbd_leds = ((b>>1)&1) | (((b>>2)&1)<<1) | ((b&1)<<2);
+        update_leds();
+        ps2_reply(0xFA);
+        break;
+      case 0xF3:
+        //Delay (1+D)*250ms, period (8+A)*2^B*4.17ms
+        rep_first_us = 250000 * (1 + ((b>>5)&3));
+        rep_next_us = (8 + (b&7)) * (1 << ((b>>3)&3)) * 4170;
+        ps2_reply(0xFA);
+        dprint(("Typematic %lu/%lu us\r\n", (unsigned long)rep_first_us, (unsigned long)rep_next_us));
+        break;
+      case 0xF0:
+        ps2_reply(0xFA);
+        //No set 3, it gets set 2
+        if (!b) ps2_reply(ps2_set);
+        else ps2_set = (b == 1) ? 1 : 2;
+        break;
+    }
+    cmd = 0;
+    return;
+  }
+  cmd = 0;
+
+  dprint(("AT cmd %X\r\n", b));
+  switch (b) {
+    case 0xED:
+    case 0xF3:
+    case 0xF0:
+      cmd = b;
+      ps2_reply(0xFA);
+      break;
+    case 0xEE:
+      ps2_reply(0xEE);
+      break;
+    case 0xF2:
+      ps2_reply(0xFA);
+      ps2_reply(0xAB);
+      ps2_reply(0x83);
+      break;
+    case 0xF4:
+      ps2_scanning = true;
+      ps2_reply(0xFA);
+      break;
+    case 0xF5:
+      ps2_scanning = false;
+      clear_pins();
+      ps2_defaults();
+      ps2_reply(0xFA);
+      break;
+    case 0xF6:
+      ps2_defaults();
+      ps2_reply(0xFA);
+      break;
+    case 0xFE:
+      ps2_reply(last);
+      break;
+    case 0xFF:
+      //Queue is dropped, self test always passes
+      clear_pins();
+      ps2_defaults();
+      ps2_scanning = true;
+      ps2_reply(0xFA);
+      ps2_reply(0xAA);
+      break;
+    default:
+      ps2_reply(0xFA);
+  }
+}
+
+//Bytes from host, collected by ps2_rx_irq
+void ps2_task(void) {
+  uint8_t b;
+  while (ps2_rx_tail != ps2_rx_head) {
+    ps2_rx_t *r = &ps2_rx[ps2_rx_tail % PS2_RX];
+    if (ps2_dev_decode(r->w, &b)) ps2_command(b, r->last);
+    else ps2_reply(0xFE);
+    ps2_rx_tail++;
+  }
+}
+
+static inline void out_init(void) {
+  kbd_offset = pio_add_program(kbd_pio, &ps2_dev_program);
+  ps2_dev_program_init(kbd_pio, kbd_sm, kbd_offset, xt_clk_pin);
+  pio_set_irq0_source_enabled(kbd_pio, pis_sm0_rx_fifo_not_empty + kbd_sm, true);
+  irq_set_exclusive_handler(PIO0_IRQ_0, ps2_rx_irq);
+  irq_set_enabled(PIO0_IRQ_0, true);
+}
+
+//Host paces us with CLK inhibit
+static inline uint out_encode(uint32_t *w, uint8_t code, uint32_t pulse_us, uint32_t gap_us) {
+  uint n = 0;
+  if (ps2_set == 1) {
+    w[n++] = ps2_dev_frame(code);
+  } else {
+    if (code&0x80) w[n++] = ps2_dev_frame(0xF0);
+    code &= 0x7F;
+    code = (code < sizeof(XT2SET2)) ? XT2SET2[code] : 0;
+    w[n++] = ps2_dev_frame(code);
+  }
+  return n;
+}
+
+static inline void out_reset(void) {
+  ps2_dev_reset(kbd_pio, kbd_sm, kbd_offset, xt_clk_pin);
+  ps2_tx_tail = ps2_tx_head;
+}
+
+static inline int64_t out_frame_us(uint32_t gap_us) {
+  return PS2_DEV_FRAME_US;
+}
+
+static inline int64_t out_poll_us(uint32_t gap_us) {
+  return PS2_DEV_FRAME_US;
+}
+
+//Edge is the end of the byte: previous one in flight, then ours
+//Host inhibit counts as a miss
+static inline uint32_t out_emit_budget_us(void) {
+  return 2 * PS2_DEV_FRAME_US;
+}
+
+static inline bool out_enabled(void) {
+  return ps2_scanning;
+}
+
+static inline bool out_replies(void) {
+  return ps2_tx_push();
+}
+
+//PS2 SM polls the lines and never stalls, last byte is on the wire
+static inline void out_drain_start(void) {
+}
+
+static inline bool out_drained(void) {
+  return pio_sm_is_tx_fifo_empty(kbd_pio, kbd_sm);
+}
+
+//Host commands, LEDs are set from here
+static inline void out_task(void) {
+  ps2_task();
+}
+
+#elif OUTPUT == OUT_SIM
+
+//Codes take as long as on Book8088 bus but go nowhere
+//Queueing, pacing and bulk can be measured without a Book
+#define OUT_NAME "Simulated"
+#define OUT_CAPS 0
+#define OUT_WORDS 1
+#define OUT_EDGE_WORDS 1
+
+#define SIM_LOG 64
+
+volatile uint32_t sim_busy_until = 0;
+uint8_t sim_log[SIM_LOG];
+uint32_t sim_log_time[SIM_LOG];
+volatile uint8_t sim_head = 0;
+uint8_t sim_tail = 0;
+
+static inline void out_init(void) {
+}
+
+static inline uint out_encode(uint32_t *w, uint8_t code, uint32_t pulse_us, uint32_t gap_us) {
+  w[0] = code;
+  return 1;
+}
+
+static inline void out_emit(uint8_t code, uint32_t pulse_us, uint32_t gap_us) {
+  uint32_t now = time_us_32();
+  sim_busy_until = now + timing->setup_us + pulse_us + gap_us;
+  sim_log[sim_head % SIM_LOG] = code;
+  sim_log_time[sim_head % SIM_LOG] = now;
+  sim_head++;
+  //Nothing is ahead of it, INT would rise after setup
+  out_pushed++;
+  out_edge(now + timing->setup_us);
+}
+
+static inline bool out_idle(void) {
+  return (int32_t)(time_us_32() - sim_busy_until) >= 0;
+}
+
+static inline void out_reset(void) {
+  sim_busy_until = time_us_32();
+}
+
+static inline int64_t out_frame_us(uint32_t gap_us) {
+  return timing_frame(timing, gap_us);
+}
+
+static inline int64_t out_poll_us(uint32_t gap_us) {
+  return timing_frame(timing, gap_us);
+}
+
+static inline uint32_t out_emit_budget_us(void) {
+  return timing->setup_us;
+}
+
+static inline bool out_enabled(void) {
+  return true;
+}
+
+static inline bool out_replies(void) {
+  return false;
+}
+
+static inline void out_drain_start(void) {
+}
+
+static inline bool out_drained(void) {
+  return out_idle();
+}
+
+//Print what would go to the bus, oldest entries are lost if UART can't keep up
+static inline void out_task(void) {
+  static uint32_t prev = 0;
+  uint8_t head = sim_head;
+
+  if ((uint8_t)(head - sim_tail) > SIM_LOG) sim_tail = head - SIM_LOG;
+  while (sim_tail != head) {
+    uint8_t i = sim_tail++ % SIM_LOG;
+    printf("Sim: %02X, +%lu us\r\n", sim_log[i], (unsigned long)(sim_log_time[i] - prev));
+    prev = sim_log_time[i];
+  }
+}
+
+#else
+#error Unknown OUTPUT, see output.h
+#endif
+
+#if OUT_CAPS & OUT_CAP_PIO
+//Data, INT pulse and gap are generated by PIO, we only push the code
+static inline void out_emit(uint8_t code, uint32_t pulse_us, uint32_t gap_us) {
+  uint32_t w[OUT_WORDS];
+  uint n = out_encode(w, code, pulse_us, gap_us);
+  for (uint i=0; i<n; i++) pio_sm_put_blocking(kbd_pio, kbd_sm, w[i]);
+  out_pushed += n / OUT_EDGE_WORDS;
+}
+
+//Previous byte is taken by PIO, so next one won't wait in FIFO
+static inline bool out_idle(void) {
+  return pio_sm_is_tx_fifo_empty(kbd_pio, kbd_sm);
+}
+#endif
+
+void send_code(uint8_t code) {
+  out_emit(code, timing->pulse_us, pace_gap);
+}
+
+//Called once per sent byte
+//Backlog or byte waited longer than a frame - halve the distance to the floor,
+//otherwise relax back to profile gap
+void pace_update(void) {
+  const timing_profile_t *t = timing;
+  uint32_t gap = pace_gap;
+
+  if (fifo_count() || pace_wait > timing_frame(t, gap)) {
+    gap = pace_floor + (gap - pace_floor) / 2;
+  } else {
+    gap += (t->gap_us - gap + 3) / 4;
+  }
+  if (gap > t->gap_us) gap = t->gap_us;
+  if (gap < pace_floor) gap = pace_floor;
+  pace_gap = gap;
+}
+
+//core1, only reads core0 stats, see stats.h
+void pace_report(void) {
+  const timing_profile_t *t = timing;
+  uint32_t gap = pace_gap;
+  stat_snap_t dl[DL_STAGES];
+  static uint32_t collapsed_seen = 0, dups_seen = 0;
+  uint32_t collapsed = rep_collapsed, dups = rep_dups;
+
+  for (uint i=0; i<DL_STAGES; i++) dl[i] = stat_take(&deadlines[i].stat);
+  printf("Pacing: gap %lu us, floor %lu us, nominal %lu us, %lu bytes/s, max wait %lu us\r\n",
+         (unsigned long)gap, (unsigned long)pace_floor, (unsigned long)t->gap_us,
+         (unsigned long)(1000000 / timing_frame(t, gap)), (unsigned long)dl[DL_QUEUE].worst);
+  for (uint i=0; i<QUEUES; i++) {
+    key_queue_t *q = queues[i];
+    kq_stats_t s = kq_stats(q);
+    printf("Queue %s: %u of %u waiting, high %u, makes dropped %u, breaks/modifiers lost %u\r\n",
+           q->name, kq_count(q), KEY_QUEUE_SIZE, s.high, s.drops, s.lost);
+  }
+  printf("Repeats collapsed under backlog: %lu, held key makes skipped: %lu\r\n",
+         (unsigned long)(collapsed - collapsed_seen), (unsigned long)(dups - dups_seen));
+  collapsed_seen = collapsed;
+  dups_seen = dups;
+  if (report_merged) {
+    printf("USB reports merged: %lu\r\n", (unsigned long)report_merged);
+    report_merged = 0;
+  }
+  static const char * const lat_name[LAT_SOURCES] = {"built-in", "USB"};
+  for (uint i=0; i<LAT_SOURCES; i++) {
+    stat_snap_t s = stat_take(&lat_stats[i]);
+    if (!s.count) continue;
+    printf("Latency %s: %lu codes, avg %lu us, max %lu us\r\n", lat_name[i], (unsigned long)s.count,
+           (unsigned long)(s.sum / s.count), (unsigned long)s.worst);
+  }
+  printf("Deadlines%s:\r\n", det_mode ? ", deterministic mode" : "");
+  for (uint i=0; i<DL_STAGES; i++) {
+    printf("  %s: %lu checked, worst %lu us, budget %lu us, missed %lu\r\n", deadlines[i].name,
+           (unsigned long)dl[i].count, (unsigned long)dl[i].worst, (unsigned long)deadlines[i].budget_us,
+           (unsigned long)dl[i].misses);
+  }
+}
+
+//Hotkey, core1
+void det_toggle(void) {
+  det_mode = !det_mode;
+  printf("Deterministic mode %s\r\n", det_mode ? "on" : "off");
+  //Leds that changed meanwhile
+  if (!det_mode) update_leds();
+}
+
+//Output frame, runs from timer IRQ
+int64_t output_alarm(alarm_id_t id, void *user_data) {
+  wake_count[WAKE_ALARM]++;
+  key_event_t ev;
+  int64_t frame = out_frame_us(pace_gap);
+  int64_t poll = out_poll_us(pace_gap);
+
+  next_frame = make_timeout_time_us(poll);
+
+  //Replies go first, bulk chunk owns PIO FIFO until DMA is done
+  bool held = out_replies();
+  if (!held && !bulk_busy && out_idle()) {
+    uint32_t start = time_us_32();
+    ev = main_cycle();
+    if (ev.code) {
+      pace_update();
+      emit_expect(start);
+      send_code(ev.code);
+      latency_note(ev);
+    }
+  }
+
+  //Interactive keys are out, resume bulk stream
+  if (!held && !bulk_busy && bulk_len && !fifo_count()) bulk_next();
+
+  out_alarm_due = next_frame;
+  if (fifo_count() || held) return -poll;
+#if !(OUT_CAPS & OUT_CAP_PIO)
+  //No DMA, bulk stream is fed from here
+  if (bulk_len) return -poll;
+#endif
+
+  //Wake up right when repeat is due, wake_output brings it closer for new keys
+  if (last_key && repeat_key) {
+    int64_t wait = absolute_time_diff_us(get_absolute_time(), rep_time);
+    if (wait < frame) wait = frame;
+    out_alarm_due = make_timeout_time_us(wait);
+    return -wait;
+  }
+
+  //Nothing queued and no key to repeat - stop until fifo_put wakes us
+  //Pacing is back to nominal after idle
+  pace_gap = timing->gap_us;
+  out_alarm = 0;
+  return 0;
+}
+
+//--------------------------------------------------
+//Bulk output
+//Pasted or scripted streams go to PIO by DMA in small chunks,
+//interactive keys from fifo go in between chunks
+//--------------------------------------------------
+
+//Must be called with interrupts off or from IRQ
+//Returns false when stream is done
+static bool bulk_next(void) {
+  uint n = 0;
+
+  if (bulk_pos >= bulk_len) {
+    if (bulk_len) {
+      //Everything is queued, bulk_drain_poll waits until it is out
+      out_drain_start();
+      bulk_stat_count = bulk_len;
+      add_alarm_in_us(out_poll_us(pace_gap), bulk_drain_poll, NULL, true);
+    }
+    bulk_len = 0;
+    bulk_pos = 0;
+    return false;
+  }
+
+#if !(OUT_CAPS & OUT_CAP_PIO)
+  //One code per output frame
+  if (out_idle()) {
+    bulk_code_t *b = &bulk_codes[bulk_pos++];
+    uint32_t pulse = b->pulse_us ? b->pulse_us : timing->pulse_us;
+    uint32_t gap = b->gap_us ? b->gap_us : pace_gap;
+    out_emit(b->code, pulse, gap);
+    bulk_stat_expect += timing->setup_us + pulse + gap;
+  }
+  return true;
+#endif
+
+  for (uint i=0; i<BULK_CHUNK && bulk_pos<bulk_len; i++) {
+    bulk_code_t *b = &bulk_codes[bulk_pos++];
+    uint32_t pulse = b->pulse_us ? b->pulse_us : timing->pulse_us;
+    uint32_t gap = b->gap_us ? b->gap_us : pace_gap;
+    n += out_encode(&bulk_words[n], b->code, pulse, gap);
+    bulk_stat_expect += timing->setup_us + pulse + gap;
+  }
+  bulk_busy = true;
+  out_pushed += n / OUT_EDGE_WORDS;
+  dma_channel_transfer_from_buffer_now(bulk_dma, bulk_words, n);
+  return true;
+}
+
+void bulk_dma_irq(void) {
+  wake_count[WAKE_DMA]++;
+  dma_hw->ints0 = 1u << bulk_dma;
+  if (!bulk_busy) return;
+  bulk_busy = false;
+  //Keys from fifo first, output alarm will resume the stream
+  if (fifo_count()) return;
+  //So do replies, alarm polls until they are out
+  if (out_replies()) wake_output();
+  else bulk_next();
+}
+
+//Codes are copied, false if previous stream is still running
+bool bulk_send(const bulk_code_t *codes, uint16_t count) {
+  if (count > BULK_MAX) count = BULK_MAX;
+  uint32_t irq = save_and_disable_interrupts();
+  if (bulk_len) {
+    restore_interrupts(irq);
+    return false;
+  }
+  memcpy(bulk_codes, codes, count * sizeof(bulk_code_t));
+  bulk_len = count;
+  bulk_pos = 0;
+  bulk_stat_start = time_us_32();
+  bulk_stat_expect = 0;
+  //If output is busy, it picks the stream up once fifo is empty
+#if OUT_CAPS & OUT_CAP_PIO
+  if (!out_alarm && !fifo_count() && !out_replies()) bulk_next();
+  //Alarm parked for repeat or waiting replies start it on the next frame
+  else wake_output();
+#else
+  wake_output();
+#endif
+  restore_interrupts(irq);
+  return true;
+}
+
+//Interrupts must be off
+static void bulk_stop(void) {
+  bulk_len = 0;
+  bulk_pos = 0;
+  bulk_busy = false;
+#if OUT_CAPS & OUT_CAP_PIO
+  dma_channel_abort(bulk_dma);
+  dma_hw->ints0 = 1u << bulk_dma;
+#endif
+}
+
+void bulk_init(void) {
+#if OUT_CAPS & OUT_CAP_PIO
+  bulk_dma = dma_claim_unused_channel(true);
+  dma_channel_config c = dma_channel_get_default_config(bulk_dma);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+  channel_config_set_read_increment(&c, true);
+  channel_config_set_write_increment(&c, false);
+  //Paced by PIO TX FIFO
+  channel_config_set_dreq(&c, pio_get_dreq(kbd_pio, kbd_sm, true));
+  dma_channel_configure(bulk_dma, &c, &kbd_pio->txf[kbd_sm], bulk_words, 0, false);
+  dma_channel_set_irq0_enabled(bulk_dma, true);
+  irq_set_exclusive_handler(DMA_IRQ_0, bulk_dma_irq);
+  irq_set_enabled(DMA_IRQ_0, true);
+#endif
+}
+
+//Once per frame until the last code is out
+int64_t bulk_drain_poll(alarm_id_t id, void *user_data) {
+  if (!out_drained()) return -out_poll_us(pace_gap);
+  bulk_stat_took = time_us_32() - bulk_stat_start;
+  bulk_report = true;
+  return 0;
+}
+
+bool bulk_ready(void) {
+  return bulk_report;
+}
+
+//Rate check, once the stream is out
+//Interactive keys sent in between make it longer
+void bulk_check(void) {
+  bulk_report = false;
+  uint32_t took = bulk_stat_took;
+  printf("Bulk: %u codes in %lu us, expected %lu us, %lu codes/s\r\n", bulk_stat_count,
+         (unsigned long)took, (unsigned long)bulk_stat_expect,
+         (unsigned long)((uint64_t)bulk_stat_count * 1000000 / (took ? took : 1)));
+}
+
+//Set by UART RX IRQ, paste_task reads everything
+volatile bool uart_pending = true;
+
+bool paste_ready(void) {
+  return uart_pending;
+}
+
+//Text pasted into UART console is typed on Book
+void paste_task(void) {
+  static char buf[PASTE_MAX];
+  static uint16_t len = 0;
+  static uint32_t last = 0;
+  static bulk_code_t codes[BULK_MAX];
+  int c;
+
+  uart_pending = false;
+  while (len<PASTE_MAX && (c = getchar_timeout_us(0)) >= 0) {
+    buf[len++] = c;
+    last = time_us_32();
+  }
+
+  //Wait for paste to finish and for previous stream
+  //Deterministic mode keeps pasted text until it is off
+  if (!len || bulk_len || det_mode) return;
+  if (len<PASTE_MAX && time_us_32()-last < PASTE_IDLE_US) return;
+
+  uint16_t n = 0;
+  for (uint16_t i=0; i<len; i++) {
+    uint8_t code = ASCII2XT[buf[i]&0x7F];
+    //CR LF is one Enter
+    if (buf[i]=='\n' && i && buf[i-1]=='\r') continue;
+    if (!code) continue;
+    if (code&0x80) codes[n++].code = SHIFTL;
+    codes[n++].code = code&0x7F;
+    codes[n++].code = (code&0x7F)|0x80;
+    if (code&0x80) codes[n++].code = SHIFTL|0x80;
+  }
+  len = 0;
+  if (n) bulk_send(codes, n);
+}
+
+#ifdef BUS_CAPTURE
+//--------------------------------------------------
+//Bus capture
+//What we really put on the bus, to check timing without a scope
+//--------------------------------------------------
+
+#define CAPTURE_MAX 256
+
+typedef struct {
+  uint32_t delay_us;
+  uint8_t  level;
+  uint8_t  code;
+} capture_t;
+
+PIO  cap_pio = pio1;
+uint cap_sm;
+
+capture_t cap_log[CAPTURE_MAX];
+volatile uint16_t cap_head = 0;
+volatile uint16_t cap_tail = 0;
+volatile uint16_t cap_lost = 0;
+
+//SM pushes delay and level/data words in pairs
+void capture_irq(void) {
+  static uint32_t delay;
+  static bool have_delay = false;
+
+  while (!pio_sm_is_rx_fifo_empty(cap_pio, cap_sm)) {
+    uint32_t w = pio_sm_get(cap_pio, cap_sm);
+    if (!have_delay) {
+      delay = w + BUS_CAPTURE_OVERHEAD_US;
+      have_delay = true;
+      continue;
+    }
+    have_delay = false;
+    if ((uint16_t)(cap_head - cap_tail) >= CAPTURE_MAX) {
+      cap_lost++;
+      continue;
+    }
+    capture_t *c = &cap_log[cap_head % CAPTURE_MAX];
+    c->delay_us = delay;
+    c->level = (w >> 8) & 1;
+    c->code = w & 0xFF;
+    cap_head++;
+  }
+}
+
+void capture_init(void) {
+  cap_sm = pio_claim_unused_sm(cap_pio, true);
+  uint offset = pio_add_program(cap_pio, &bus_capture_program);
+  bus_capture_program_init(cap_pio, cap_sm, offset, kbd_out_base, int_pin);
+  pio_set_irq0_source_enabled(cap_pio, pis_sm0_rx_fifo_not_empty + cap_sm, true);
+  irq_set_exclusive_handler(PIO1_IRQ_0, capture_irq);
+  irq_set_enabled(PIO1_IRQ_0, true);
+}
+
+//Prints and drops everything captured so far
+//Gaps longer than a nominal frame are idle time, they are not counted
+void capture_report(void) {
+  const timing_profile_t *t = timing;
+  uint32_t idle = timing_frame(t, t->gap_us);
+  uint32_t pulses = 0, pulse_min = 0xFFFFFFFF, pulse_max = 0;
+  uint32_t gaps = 0, gap_min = 0xFFFFFFFF, gap_max = 0;
+  uint64_t pulse_sum = 0, gap_sum = 0;
+  uint16_t changed = 0;
+  uint8_t code = 0;
+
+  while (cap_tail != cap_head) {
+    capture_t *c = &cap_log[cap_tail % CAPTURE_MAX];
+    printf("Interrupt: %u, Delay: %lu us\r\n", c->level, (unsigned long)c->delay_us);
+    if (c->level) {
+      code = c->code;
+      if (c->delay_us <= idle) {
+        gaps++;
+        gap_sum += c->delay_us;
+        if (c->delay_us < gap_min) gap_min = c->delay_us;
+        if (c->delay_us > gap_max) gap_max = c->delay_us;
+      }
+    } else {
+      //Data must hold for the whole pulse
+      if (c->code != code) changed++;
+      pulses++;
+      pulse_sum += c->delay_us;
+      if (c->delay_us < pulse_min) pulse_min = c->delay_us;
+      if (c->delay_us > pulse_max) pulse_max = c->delay_us;
+    }
+    cap_tail++;
+  }
+
+  if (pulses) printf("Capture: %lu pulses, %lu-%lu us, avg %lu us, profile %lu us\r\n",
+                     (unsigned long)pulses, (unsigned long)pulse_min, (unsigned long)pulse_max,
+                     (unsigned long)(pulse_sum / pulses), (unsigned long)t->pulse_us);
+  if (gaps) printf("Capture: %lu gaps, %lu-%lu us, avg %lu us, profile %lu-%lu us\r\n",
+                   (unsigned long)gaps, (unsigned long)gap_min, (unsigned long)gap_max,
+                   (unsigned long)(gap_sum / gaps), (unsigned long)(t->setup_us + pace_floor),
+                   (unsigned long)(t->setup_us + t->gap_us));
+  printf("Capture: %u codes changed during INT, %u edges lost\r\n", changed, cap_lost);
+  cap_lost = 0;
+}
+#endif
+
+//Interrupts must be off
+static void wake_output(void) {
+  //Keep at least one frame since last byte
+  absolute_time_t at = delayed_by_us(get_absolute_time(), KBD_WAKE);
+  if (absolute_time_diff_us(at, next_frame) > 0) at = next_frame;
+  if (out_alarm) {
+    //Parked until repeat is due - new key must not wait for it
+    if (absolute_time_diff_us(out_alarm_due, at) >= 0) return;
+    cancel_alarm(out_alarm);
+  }
+  out_alarm_due = at;
+  out_alarm = add_alarm_at(at, output_alarm, NULL, true);
+}
+
+//Built-in keyboard is sampled at timing->scan_us while it shares output:
+//USB keys or backlog, or pins are not idle. Pin change starts it again
+repeating_timer_t scan_timer;
+volatile bool scan_on = false;
+
+static inline bool scan_needed(void) {
+  return local_key || fifo_count() || bulk_len;
+}
+
+bool scan_input(repeating_timer_t *rt) {
+  wake_count[WAKE_SCAN]++;
+  get_input();
+  if (scan_needed()) return true;
+  scan_on = false;
+  return false;
+}
+
+//core0, interrupts off or IRQ
+static void scan_start(void) {
+  if (scan_on) return;
+  scan_on = true;
+  add_repeating_timer_us(-(int64_t)timing->scan_us, scan_input, NULL, &scan_timer);
+}
+
+//Passthrough: no USB keyboard and nothing queued - built-in keyboard is sampled
+//on pin change, not on scan_timer, so it goes out right away
+//Lines don't change all at once, sample is taken when they settle
+#define PASS_SETTLE_US 50
+
+volatile alarm_id_t pass_alarm = 0;
+
+int64_t pass_sample(alarm_id_t id, void *user_data) {
+  pass_alarm = 0;
+  get_input();
+  return 0;
+}
+
+void input_edge(uint gpio, uint32_t events) {
+#if OUTPUT == OUT_XT
+  if (gpio == xt_clk_pin) {
+    xt_clk_edge();
+    return;
+  }
+#endif
+  wake_count[WAKE_EDGE]++;
+  //USB keys or backlog - scan_timer and fifo arbitrate as usual
+  if (kbd_conn || fifo_count() || bulk_len) {
+    scan_start();
+    return;
+  }
+  if (pass_alarm) return;
+  pass_alarm = add_alarm_in_us(PASS_SETTLE_US, pass_sample, NULL, true);
+}
+
+void set_timing(uint8_t profile) {
+  if (profile >= TIMING_PROFILES) return;
+  timing = &timing_profiles[profile];
+  pace_floor = timing->min_gap_us;
+  pace_gap = timing->gap_us;
+  deadlines[DL_EMIT].budget_us = out_emit_budget_us();
+  rep_first_us = timing->first_us;
+  rep_next_us = timing->next_us;
+  //New period, it stops by itself if nothing needs it
+  uint32_t irq = save_and_disable_interrupts();
+  if (scan_on) cancel_repeating_timer(&scan_timer);
+  scan_on = false;
+  scan_start();
+  restore_interrupts(irq);
+  printf("Timing: %s\r\n", timing->name);
+}
+
+//core0
+void event_task(void) {
+  if (multicore_fifo_rvalid()) wake_count[WAKE_CORE1]++;
+  while (multicore_fifo_rvalid()) {
+    uint32_t ev = multicore_fifo_pop_blocking();
+    uint8_t arg = ev & 0xFF;
+    switch (ev >> 8) {
+      case EV_KEY:
+        key_event_posted = false;
+        __dmb();
+        fifo_wake();
+        break;
+      case EV_CLEAR:  clear_pins(); break;
+      case EV_TIMING: set_timing(arg); break;
+    }
+  }
+}
+
+//Shared with TinyUSB handler on core1, only keeps time of the first IRQ,
+//so delays are counted from the transfer, not from when core1 got to it
+void usb_irq_stamp(void) {
+  if (usb_irq_pending) return;
+  usb_irq_us = time_us_32();
+  usb_irq_frame = usb_hw->sof_rd & USB_SOF_RD_BITS;
+  usb_irq_pending = true;
+}
+
+//Transfer complete IRQ wakes us inside the frame it finished in,
+//tuh_task runs at once instead of on a timer unrelated to SOF
+void usb_task(void) {
+  uint32_t irq = save_and_disable_interrupts();
+  //Reports of this pass came with that IRQ or a later one
+  usb_pass_us = usb_irq_pending ? usb_irq_us : time_us_32();
+  usb_pass_frame = usb_irq_pending ? usb_irq_frame : (usb_hw->sof_rd & USB_SOF_RD_BITS);
+  usb_irq_pending = false;
+  restore_interrupts(irq);
+  //Handlers only queue reports, report_task runs right after
+  tuh_task();
+}
+
+bool report_ready(void) {
+  return report_tail != report_head;
+}
+
+bool leds_ready(void) {
+  return leds_pending && !det_mode;
+}
+
+//Main loop work of both cores, table order is priority, see sched.h
+//Output frames and built-in keyboard sampling are hardware alarms, not tasks
+task_t core0_tasks[] = {
+  //Keys and commands from core1
+  {.name = "events", .run = event_task, .ready = multicore_fifo_rvalid, .budget_us = 50},
+  //Backend work, XT reset, AT host commands
+  {.name = "output", .run = out_task, .budget_us = 100},
+  //Text from UART console, period flushes it after PASTE_IDLE_US
+  {.name = "paste",  .run = paste_task, .ready = paste_ready, .period_us = PASTE_IDLE_US, .budget_us = 500},
+  //Bulk stream result, printing has no budget
+  {.name = "bulk",   .run = bulk_check, .ready = bulk_ready},
+};
+
+task_t core1_tasks[] = {
+  {.name = "usb",     .run = usb_task, .ready = tuh_task_event_ready, .budget_us = 500},
+  {.name = "reports", .run = report_task, .ready = report_ready, .budget_us = 200},
+  {.name = "leds",    .run = leds_task, .ready = leds_ready, .budget_us = 100},
+};
+
+sched_t core0_sched = SCHED("core0", core0_tasks);
+sched_t core1_sched = SCHED("core1", core1_tasks);
+
+//USB enumeration and control transfers don't hold output back
+void core1_main(void) {
+  tuh_init(BOARD_TUH_RHPORT);
+  irq_add_shared_handler(USBCTRL_IRQ, usb_irq_stamp, PICO_SHARED_IRQ_HANDLER_HIGHEST_ORDER_PRIORITY);
+  sched_init(&core1_sched);
+  while (true) {
+    sched_pass(&core1_sched);
+    //USB IRQ or led request from core0 wakes us
+    if (sched_sleep(&core1_sched)) core_wakes[1]++;
+  }
+}
+
+//UART RX IRQ, stays off until paste_task reads
+void uart_rx(void *param) {
+  wake_count[WAKE_UART]++;
+  uart_pending = true;
+}
+
+void task_report(void) {
+  sched_report(&core0_sched);
+  sched_report(&core1_sched);
+}
+
+//core1, counters are only read
+void wake_report(void) {
+  static uint32_t wake_seen[WAKE_SOURCES], core_seen[2];
+  uint32_t w[WAKE_SOURCES], c[2];
+
+  for (uint i=0; i<WAKE_SOURCES; i++) {
+    uint32_t n = wake_count[i];
+    w[i] = n - wake_seen[i];
+    wake_seen[i] = n;
+  }
+  for (uint i=0; i<2; i++) {
+    uint32_t n = core_wakes[i];
+    c[i] = n - core_seen[i];
+    core_seen[i] = n;
+  }
+  printf("Wakeups: core0 %lu - alarm %lu, scan %lu, edge %lu, dma %lu, core1 %lu, uart %lu; core1 %lu\r\n",
+         (unsigned long)c[0], (unsigned long)w[WAKE_ALARM], (unsigned long)w[WAKE_SCAN],
+         (unsigned long)w[WAKE_EDGE], (unsigned long)w[WAKE_DMA], (unsigned long)w[WAKE_CORE1],
+         (unsigned long)w[WAKE_UART], (unsigned long)c[1]);
+}
+
+void usb_delay_report(void) {
+  printf("USB IRQ to report delay, us:");
+  for (uint i=0; i<USB_DELAY_BUCKETS; i++) {
+    if (i < USB_DELAY_BUCKETS - 1) printf(" <%u:%lu", 32u << i, (unsigned long)usb_delay_hist[i]);
+    else printf(" more:%lu", (unsigned long)usb_delay_hist[i]);
+  }
+  printf("; max %lu, frame slips %lu\r\n", (unsigned long)usb_delay_max, (unsigned long)usb_frame_slips);
+  memset(usb_delay_hist, 0, sizeof(usb_delay_hist));
+  usb_delay_max = usb_frame_slips = 0;
+}
+
+//Next pin after previous one is also next bit, same run
+void in_runs_init(void) {
+  pin_run_t *r = NULL;
+  for (uint i=0; i<8; i++) {
+    if (!r || kbd_in_pins[i] != kbd_in_pins[i-1] + 1) {
+      r = &kbd_in_runs[kbd_in_run_count++];
+      r->mask = 0;
+      r->shift = kbd_in_pins[i] - i;
+    }
+    r->mask |= 1u << kbd_in_pins[i];
+  }
+}
 
 int main(void)
 {
@@ -144,53 +1655,42 @@ int main(void)
 
   printf("External keyboard support for Book8088\r\n");
   printf("(C) 2023-2024 Serhii Liubshin\r\n");
+  printf("Output: %s, board %s\r\n", OUT_NAME, BOARD_NAME);
+
+  kbd_sm = pio_claim_unused_sm(kbd_pio, true);
+  out_init();
+  bulk_init();
+  turbo_init();
+  reset_init();
+#ifdef BUS_CAPTURE
+  capture_init();
+#endif
 
-//We use pins 2,3,4,5,6,7,8,9 for bits
-//Pin 10 - to signal interrupt
-
-  for (int i=0;i<8;i++) {
-      gpio_init(kbd_out_pins[i]);
-      gpio_set_dir(kbd_out_pins[i],GPIO_OUT);
-  }
-  gpio_init(int_pin);
-  gpio_set_dir(int_pin,GPIO_OUT);
-
+  in_runs_init();
   for (int i=0;i<8;i++) {
       gpio_init(kbd_in_pins[i]);
       gpio_set_dir(kbd_in_pins[i],GPIO_IN);
       gpio_pull_up(kbd_in_pins[i]);
+      gpio_set_irq_enabled_with_callback(kbd_in_pins[i], GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, input_edge);
   }
 
+  //Also starts built-in keyboard sampling, alarms stay on core0
+  set_timing(TIMING_PROFILE);
+  stdio_set_chars_available_callback(uart_rx, NULL);
 
-tuh_init(BOARD_TUH_RHPORT);
+  multicore_launch_core1(core1_main);
 
 //--------------------------------------------------
 //Main loop
 //--------------------------------------------------
+//Output frames are driven by alarms, INT pulse is timed by PIO,
+//USB runs on core1
+//Every IRQ or event from core1 wakes us, nothing is polled while idle
+  sched_init(&core0_sched);
   while (true)
   {
-
-      for (uint8_t i=0; i<5; i++) {
-      //External keyboard is processed in tinyusb handlers
-      tuh_task();
-      //Built-in keyboard
-      get_input();
-      sleep_us(KBD_CYCLE);
-      }
-
-      uint8_t code = main_cycle();
-      if (code) raise_interrupt(code);
-
-      for (uint8_t i=0; i<5; i++) {
-      //External keyboard is processed in tinyusb handlers
-      tuh_task();
-      //Built-in keyboard
-      get_input();
-      sleep_us(KBD_CYCLE);
-      }
-
-      lower_interrupt();
-
+      sched_pass(&core0_sched);
+      if (sched_sleep(&core0_sched)) core_wakes[0]++;
   }
 
   return 0;
@@ -210,17 +1710,16 @@ Native timings:
 
 uint8_t code;
   code = 0;
-  //recreate scancode from pins
-  for (int i=0;i<8;i++) {
-  code=code>>1;
-  if (gpio_get(kbd_in_pins[i])) code=code|0x80;
-  }
+  //recreate scancode from pins, all of them are sampled at once
+  uint32_t all = gpio_get_all();
+  for (uint i=0; i<kbd_in_run_count; i++)
+    code |= (all & kbd_in_runs[i].mask) >> kbd_in_runs[i].shift;
 
   if (local_key == code) return;
 
   local_key = code;
 
-  fifo_put(code);
+  fifo_put(&local_queue, kev_make(code, KEV_SRC_LOCAL, key_flags(code)));
 
 }
 
@@ -252,10 +1751,10 @@ void tuh_umount_cb(uint8_t dev_addr)
 void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_report, uint16_t desc_len) {
 //  printf("HID device address = %d, instance = %d is mounted\r\n", dev_addr, instance);
   board_led_write(1);
-  gpio_init(16);
-  gpio_put(16,1);
+  gpio_init(led_pin);
+  gpio_put(led_pin,1);
   kbd_conn = 1;
-  clear_pins();
+  post_event(EV_CLEAR, 0);
   if(tuh_hid_interface_protocol(dev_addr, instance) == HID_ITF_PROTOCOL_KEYBOARD) {
     if ( !tuh_hid_receive_report(dev_addr, instance) )
     {
@@ -267,28 +1766,32 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
 // Invoked when device with hid interface is un-mounted
 void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance) {
   board_led_write(0);
-  gpio_put(16,0);
+  gpio_put(led_pin,0);
   kbd_conn = 0;
-  clear_pins();
+  post_event(EV_CLEAR, 0);
   //printf("HID device address = %d, instance = %d is unmounted\r\n", dev_addr, instance);
 }
 
-//For setting leds
-uint8_t kbd_addr;
-uint8_t kbd_inst;
-
 // Invoked when received report from device via interrupt endpoint (key down and key up)
 void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
 {
   uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
 
-  switch (itf_protocol)
-  {
-    case HID_ITF_PROTOCOL_KEYBOARD:
-      kbd_addr = dev_addr;
-      kbd_inst = instance;
-      process_kbd_report((hid_keyboard_report_t const*) report );
-    break;
+  if (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD) {
+    uint8_t head = report_head;
+    //Every report holds the whole key state, when full keep the latest
+    if ((uint8_t)(head - report_tail) >= REPORT_RING) {
+      head--;
+      report_merged++;
+    }
+    kbd_report_t *r = &report_ring[head % REPORT_RING];
+    r->dev_addr = dev_addr;
+    r->instance = instance;
+    r->frame = usb_pass_frame;
+    r->arrival_us = usb_pass_us;
+    memset(&r->report, 0, sizeof(r->report));
+    memcpy(&r->report, report, MIN(len, sizeof(r->report)));
+    report_head = head + 1;
   }
 
   // continue to request to receive report
@@ -298,6 +1801,26 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
   }
 }
 
+//core1, everything received since last pass
+void report_task(void) {
+  while (report_tail != report_head) {
+    kbd_report_t *r = &report_ring[report_tail % REPORT_RING];
+    uint32_t delay = time_us_32() - r->arrival_us;
+    uint i = 0;
+    while (i < USB_DELAY_BUCKETS - 1 && delay >= (32u << i)) i++;
+    usb_delay_hist[i]++;
+    if (delay > usb_delay_max) usb_delay_max = delay;
+    if ((usb_hw->sof_rd - r->frame) & USB_SOF_RD_BITS) usb_frame_slips++;
+    deadline_check(DL_REPORT, delay);
+    kbd_addr = r->dev_addr;
+    kbd_inst = r->instance;
+    uint32_t start = time_us_32();
+    process_kbd_report(&r->report);
+    deadline_check(DL_PROCESS, time_us_32() - start);
+    report_tail++;
+  }
+}
+
 
 //--------------------------------------------------------------------+
 // Keyboard
@@ -314,6 +1837,14 @@ static void send_key(uint8_t code)
   //Skip zeros
   if (!(code&0x7F)) return;
 
+  //core1 is the only usb_queue producer
+  //Dropped or disabled make never reaches the host, its lock state stays
+  if (!out_enabled() || !kq_put(&usb_queue, kev_make(code, kev_usb_src(kbd_addr), key_flags(code)))) return;
+  post_key_event();
+
+#if !(OUT_CAPS & OUT_CAP_HOST_CMD)
+  //AT host sets leds itself with ED
+
   //Process NumLock, CapsLock, ScrollLock
   //0x45, 0x3A, 0x46
 
@@ -335,101 +1866,186 @@ static void send_key(uint8_t code)
   }
 
   if (set_leds) {
-     set_leds = (scroll_state<<2)|(caps_state<<1)|numlock_state;
-     //printf("LEDS:%X  ",set_leds);
-     //guess who used not static variable here? :)
-     tuh_hid_set_report(kbd_addr,kbd_inst,0,HID_REPORT_TYPE_OUTPUT,&set_leds,1);
+     kbd_leds = (scroll_state<<2)|(caps_state<<1)|numlock_state;
+     //printf("LEDS:%X  ",kbd_leds);
+     //guess who used not static variable here? :) - see leds_task
+     update_leds();
   }
+#endif
 
-  fifo_put(code);
+}
 
+//HID 1..9 - timing profile, 0 - pacing report, -/= - pacing floor, W - wakeups, U - USB delay,
+//D - deterministic mode, T - tasks, C - bus capture
+static bool is_hotkey(uint8_t keycode) {
+#ifdef BUS_CAPTURE
+  if (keycode==0x06) return true;
+#endif
+  return (keycode>=0x1E && keycode<=0x27) || keycode==0x2D || keycode==0x2E || keycode==0x1A || keycode==0x18 || keycode==0x07 || keycode==0x17;
 }
 
-static void process_kbd_report(hid_keyboard_report_t const *report)
-{
+static void hotkey(uint8_t keycode) {
+  uint32_t step = timing->gap_us / 10;
+
+  if (keycode>=0x1E && keycode<=0x26) post_event(EV_TIMING, keycode-0x1E);
+  if (keycode==0x27) pace_report();
+  if (keycode==0x2D) pace_floor = (pace_floor > step) ? pace_floor - step : 0;
+  if (keycode==0x2E) pace_floor = (pace_floor + step < timing->gap_us) ? pace_floor + step : timing->gap_us;
+  if (keycode==0x2D || keycode==0x2E) pace_report();
+  if (keycode==0x1A) wake_report();
+  if (keycode==0x18) usb_delay_report();
+  if (keycode==0x07) det_toggle();
+  if (keycode==0x17) task_report();
+#ifdef BUS_CAPTURE
+  if (keycode==0x06) capture_report();
+#endif
+}
 
-/*
-0x1D ;CTRL 0x01 | 0x10 ;Left and Right are the same on XT
-0x38 ;ALT 0x04 | 0x40 ;Left and Right are the same on XT
-0x2A ;Left SHIFT 0x02
-0x36 ;Right SHIFT 0x20
-*/
+int64_t turbo_pulse_end(alarm_id_t id, void *user_data) {
+  gpio_put(turbo_pin, 0);
+  return 0;
+}
 
-//Only six simultaneous keys :(
+int64_t turbo_blink_step(alarm_id_t id, void *user_data) {
+  turbo_blink--;
+  update_leds();
+  return turbo_blink ? TURBO_BLINK_US : 0;
+}
 
-  static uint8_t prev_keys[6] = {0};
+void turbo_toggle(void) {
+  turbo_on = !turbo_on;
+#if TURBO_PULSE_US
+  gpio_put(turbo_pin, 1);
+  add_alarm_in_us(TURBO_PULSE_US, turbo_pulse_end, NULL, true);
+#else
+  gpio_put(turbo_pin, turbo_on);
+#endif
+  //Blink already running just starts over
+  bool start = !turbo_blink;
+  turbo_blink = turbo_on ? 4 : 2;
+  if (start) add_alarm_in_us(TURBO_BLINK_US, turbo_blink_step, NULL, true);
+  update_leds();
+  printf("Turbo: %s\r\n", turbo_on ? "on" : "off");
+}
 
-  static uint8_t prev_modifiers = 0; // previous modifier
+void turbo_init(void) {
+  gpio_init(turbo_pin);
+  gpio_set_dir(turbo_pin, GPIO_OUT);
+  gpio_put(turbo_pin, 0);
+}
 
-  static uint8_t prev_ctrl_state = 0;
-  static uint8_t prev_alt_state = 0;
-  static uint8_t prev_shiftl_state = 0;
-  static uint8_t prev_shiftr_state = 0;
+static inline void reset_line(bool on) {
+#if RESET_ACTIVE_LOW
+  gpio_set_dir(reset_pin, on ? GPIO_OUT : GPIO_IN);
+#else
+  gpio_put(reset_pin, on);
+#endif
+}
 
-  uint8_t ctrl_state = 0;
-  uint8_t alt_state = 0;
-  uint8_t shiftl_state = 0;
-  uint8_t shiftr_state = 0;
+int64_t reset_release(alarm_id_t id, void *user_data) {
+  reset_line(false);
+  return 0;
+}
 
-  uint8_t modifiers = report->modifier;
+//Line goes up right here, from report callback
+void reset_book(void) {
+  reset_line(true);
+  add_alarm_in_us(RESET_PULSE_US, reset_release, NULL, true);
+  //Whatever is queued was meant for the hung program
+  post_event(EV_CLEAR, 0);
+  printf("Reset\r\n");
+}
 
-  ctrl_state = (modifiers & 0x11) ? 1 : 0;
-  alt_state = (modifiers & 0x44) ? 1 : 0;
-  shiftl_state = (modifiers & 0x2) ? 1 : 0;
-  shiftr_state = (modifiers & 0x20) ? 1 : 0;
+void reset_init(void) {
+  gpio_init(reset_pin);
+  gpio_put(reset_pin, 0);
+#if !RESET_ACTIVE_LOW
+  gpio_set_dir(reset_pin, GPIO_OUT);
+#endif
+}
 
-  if (ctrl_state!=prev_ctrl_state) {
-    ctrl_state ? send_key(CTRL) : send_key(CTRL|0x80);
-    prev_ctrl_state = ctrl_state;
+//HID usage to XT make code, 0 - not sent
+//Left and right Ctrl, Alt are the same on XT, map has them folded to left
+static uint8_t usage_to_xt(uint8_t usage) {
+  if (usage < sizeof(HID2XT)) return HID2XT[usage];
+  switch (usage) {
+    case 0xE0: return CTRL;
+    case 0xE1: return SHIFTL;
+    case 0xE2: return ALT;
+    case 0xE5: return SHIFTR;
   }
+  return 0;
+}
 
-  if (alt_state!=prev_alt_state) {
-    alt_state ? send_key(ALT) : send_key(ALT|0x80);
-    prev_alt_state = alt_state;
+//Breaks or makes for every usage set in bits of map word
+static void send_usages(uint word, uint32_t bits, bool make) {
+  while (bits) {
+    uint8_t code = usage_to_xt(km_pop(word, &bits));
+    if (code) send_key(make ? code : code|0x80);
   }
+}
 
-  if (shiftl_state!=prev_shiftl_state) {
-    shiftl_state ? send_key(SHIFTL) : send_key(SHIFTL|0x80);
-    prev_shiftl_state = shiftl_state;
-  }  
+static void process_kbd_report(hid_keyboard_report_t const *report)
+{
 
-  if (shiftr_state!=prev_shiftr_state) {
-    shiftr_state ? send_key(SHIFTR) : send_key(SHIFTR|0x80);
-    prev_shiftr_state = shiftr_state;
-  }  
+//Boot report has six keys, key maps themselves are not limited
 
-  uint8_t i,j,keycode,send_event;
+  //What Book was told, and what keyboard reported
+  static key_map_t prev_keys;
+  static key_map_t prev_raw;
+  static bool prev_reset = false;
 
-//Process key release first
-  for (i=0;i<6;i++) {
-    keycode = prev_keys[i];
-    //Skip zeros
-    if (keycode && (keycode<sizeof(HID2XT))) {
-      send_event=1;
-      for (j=0;j<6;j++) {
-        //if keycode exist, key is still pressed, if not - we need to send a release.
-	//I wonder what expected to happen if one presses seven+ keys at once
-        if (keycode == report->keycode[j]) { send_event = 0; break; }
-      }
-      if (send_event) send_key(HID2XT[keycode]|0x80);
-    }
+  key_map_t keys, raw;
+  uint8_t modifiers = report->modifier;
+  uint8_t w, usage;
+  uint32_t bits;
+
+  km_from_report(&raw, &prev_raw, modifiers, report->keycode, 6);
+  keys = raw;
+  //RCtrl to LCtrl, RAlt to LAlt
+  km_set_mods(&keys, (modifiers & 0xAF) | ((modifiers >> 4) & 0x05));
+
+//Reset chord, acts once per press
+  bool reset = false;
+  if ((modifiers & RESET_MODS) == RESET_MODS && km_test(&raw, RESET_KEY)) {
+    reset = true;
+    km_reset(&keys, RESET_KEY);
+  }
+  if (reset && !prev_reset) reset_book();
+  prev_reset = reset;
+
+//Turbo key, toggles on press and is never sent
+  if ((modifiers & TURBO_MODS) == TURBO_MODS && km_test(&raw, TURBO_KEY)) {
+    if (!km_test(&prev_raw, TURBO_KEY)) turbo_toggle();
+    km_reset(&keys, TURBO_KEY);
   }
 
-//Process key press
-  for (i=0;i<6;i++) {
-    keycode = report->keycode[i];
-    //Skip zeros
-    if (keycode && (keycode<sizeof(HID2XT))) {
-      send_event=1;
-      for (j=0;j<6;j++) {
-        //Same logic here
-        if (keycode == prev_keys[j]) { send_event = 0; break; }
+//Hotkeys, key itself is not sent
+  if ((modifiers & HOTKEY_MODS) == HOTKEY_MODS) {
+    for (w=0; w<KM_MOD_WORD; w++) {
+      bits = keys.w[w];
+      while (bits) {
+        usage = km_pop(w, &bits);
+        //Act on press only, but keep it hidden while held
+        if (!km_test(&prev_raw, usage)) hotkey(usage);
+        if (is_hotkey(usage)) km_reset(&keys, usage);
       }
-      if (send_event) send_key(HID2XT[keycode]);
     }
   }
+  prev_raw = raw;
+
+//Modifiers go first, so they are down before keys of the same report
+  bits = keys.w[KM_MOD_WORD] ^ prev_keys.w[KM_MOD_WORD];
+  send_usages(KM_MOD_WORD, bits & prev_keys.w[KM_MOD_WORD], false);
+  send_usages(KM_MOD_WORD, bits & keys.w[KM_MOD_WORD], true);
+
+//Then releases, then presses
+  for (w=0; w<KM_MOD_WORD; w++)
+    send_usages(w, (keys.w[w] ^ prev_keys.w[w]) & prev_keys.w[w], false);
+  for (w=0; w<KM_MOD_WORD; w++)
+    send_usages(w, (keys.w[w] ^ prev_keys.w[w]) & keys.w[w], true);
 
 //Save state
-  for (i=0;i<6;i++) prev_keys[i]=report->keycode[i];
+  prev_keys = keys;
 
 }
\ No newline at end of file
@@ -0,0 +1,61 @@
+#ifndef _KEY_MAP_H_
+#define _KEY_MAP_H_
+
+/*
+Key state as bitmap of HID usages, bit n set - usage n is down.
+Modifier byte of the report is folded in as usages 0xE0-0xE7,
+same as in HID usage table. Changes are found with XOR a word
+at a time, cost doesn't depend on how many keys are held and
+nothing limits the map to six keys.
+*/
+
+#define KEY_MAP_WORDS 8
+//Modifiers take the low byte of the last word
+#define KM_MOD_USAGE  0xE0
+#define KM_MOD_WORD   (KM_MOD_USAGE / 32)
+
+//Usages 1-3 are report errors, 1 - more keys than report holds
+#define KM_ROLLOVER   0x01
+#define KM_FIRST_KEY  0x04
+
+typedef struct {
+  uint32_t w[KEY_MAP_WORDS];
+} key_map_t;
+
+static inline void km_set(key_map_t *m, uint8_t usage) {
+  m->w[usage >> 5] |= 1u << (usage & 31);
+}
+
+static inline void km_reset(key_map_t *m, uint8_t usage) {
+  m->w[usage >> 5] &= ~(1u << (usage & 31));
+}
+
+static inline bool km_test(const key_map_t *m, uint8_t usage) {
+  return (m->w[usage >> 5] >> (usage & 31)) & 1;
+}
+
+static inline void km_set_mods(key_map_t *m, uint8_t modifiers) {
+  m->w[KM_MOD_WORD] = modifiers;
+}
+
+//Boot report to map, n keys
+//On rollover error keys are not known, prev is kept and only modifiers change
+static inline void km_from_report(key_map_t *m, const key_map_t *prev, uint8_t modifiers,
+                                  const uint8_t *keys, uint n) {
+  if (n && keys[0] == KM_ROLLOVER) {
+    *m = *prev;
+  } else {
+    memset(m, 0, sizeof(*m));
+    for (uint i = 0; i < n; i++) if (keys[i] >= KM_FIRST_KEY) km_set(m, keys[i]);
+  }
+  km_set_mods(m, modifiers);
+}
+
+//Lowest usage in word bits, clears it, bits must not be 0
+static inline uint8_t km_pop(uint word, uint32_t *bits) {
+  uint8_t usage = word * 32 + __builtin_ctz(*bits);
+  *bits &= *bits - 1;
+  return usage;
+}
+
+#endif
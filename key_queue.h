@@ -0,0 +1,165 @@
+#ifndef _KEY_QUEUE_H_
+#define _KEY_QUEUE_H_
+
+/*
+Key event queue, single producer, single consumer, no locks.
+Producer only writes head, consumer only writes tail, so each
+queue may be filled from another core or IRQ without disabling
+interrupts. Same for stats: producer counts, kq_stats() reader
+keeps its own totals and never writes producer fields.
+
+Last KEY_QUEUE_RESERVE slots are only for breaks and modifiers,
+under overload new makes are refused first and no key gets stuck.
+Everything stays in one queue, order of codes is kept.
+
+Key event goes from send_key/get_input to output:
+  code  - XT scancode, bit 7 is break
+  src   - where it came from, KEV_SRC_*
+  flags - KEV_*
+  stamp - arrival time, time_us_32(), compares right within ~35 minutes
+Queue may stall for seconds while XT or AT host holds the lines,
+so stamp is not shortened.
+Bulk and paste streams don't go through queues and have no records.
+*/
+
+//Sources
+#define KEV_SRC_LOCAL  0  //built-in keyboard
+#define KEV_SRC_USB    1  //USB keyboard, + device address - 1, up to 15
+
+//Flags
+#define KEV_REPEAT 0x1  //typematic repeat, stamp is from original press
+#define KEV_MOD    0x2  //Ctrl, Alt or Shift
+
+typedef struct {
+  uint8_t  code;
+  uint8_t  src   : 4;
+  uint8_t  flags : 4;
+  uint32_t stamp;
+} key_event_t;
+
+static inline key_event_t kev_make(uint8_t code, uint8_t src, uint8_t flags) {
+  key_event_t e = {.code = code, .src = src, .flags = flags, .stamp = time_us_32()};
+  return e;
+}
+
+static inline uint32_t kev_age_us(key_event_t e) {
+  return time_us_32() - e.stamp;
+}
+
+//a arrived before b
+static inline bool kev_before(key_event_t a, key_event_t b) {
+  return (int32_t)(a.stamp - b.stamp) < 0;
+}
+
+//Addresses past 14 share source 15
+static inline uint8_t kev_usb_src(uint8_t dev_addr) {
+  uint8_t src = KEV_SRC_USB + dev_addr - 1;
+  return (dev_addr && src < 15) ? src : 15;
+}
+
+//Codes per queue, must be power of two
+#ifndef KEY_QUEUE_SIZE
+#define KEY_QUEUE_SIZE 32
+#endif
+
+#if KEY_QUEUE_SIZE & (KEY_QUEUE_SIZE - 1)
+#error KEY_QUEUE_SIZE must be power of two
+#endif
+
+//Six keys and four modifiers of one USB report fit
+#ifndef KEY_QUEUE_RESERVE
+#define KEY_QUEUE_RESERVE 10
+#endif
+
+#if KEY_QUEUE_RESERVE >= KEY_QUEUE_SIZE
+#error KEY_QUEUE_RESERVE leaves no room for makes
+#endif
+
+typedef struct {
+  const char *name;
+  key_event_t ev[KEY_QUEUE_SIZE];
+  volatile uint16_t head;   //producer
+  volatile uint16_t tail;   //consumer
+  //Producer only: most codes waiting at once, new makes refused under overload,
+  //breaks and modifiers lost when completely full
+  volatile uint16_t high;
+  volatile uint16_t drops;
+  volatile uint16_t lost;
+  uint8_t high_seen;
+  //Stats reader only, see kq_stats()
+  volatile uint8_t high_epoch;
+  uint16_t drops_seen;
+  uint16_t lost_seen;
+} key_queue_t;
+
+typedef struct {
+  uint16_t high;
+  uint16_t drops;
+  uint16_t lost;
+} kq_stats_t;
+
+static inline uint16_t kq_count(const key_queue_t *q) {
+  return (uint16_t)(q->head - q->tail);
+}
+
+//Breaks and modifier changes may take reserved slots
+static inline bool kev_urgent(key_event_t e) {
+  return (e.code & 0x80) || (e.flags & KEV_MOD);
+}
+
+//Producer side
+static inline bool kq_put(key_queue_t *q, key_event_t e) {
+  uint16_t head = q->head;
+  uint16_t used = (uint16_t)(head - q->tail);
+  //Reader asked to restart high
+  if (q->high_seen != q->high_epoch) {
+    q->high_seen = q->high_epoch;
+    q->high = used;
+  }
+  if (kev_urgent(e)) {
+    if (used >= KEY_QUEUE_SIZE) {
+      q->lost++;
+      return false;
+    }
+  } else if (used >= KEY_QUEUE_SIZE - KEY_QUEUE_RESERVE) {
+    q->drops++;
+    return false;
+  }
+  q->ev[head & (KEY_QUEUE_SIZE - 1)] = e;
+  //Slot is written before consumer can see it
+  __dmb();
+  q->head = head + 1;
+  if (used + 1 > q->high) q->high = used + 1;
+  return true;
+}
+
+//Consumer side, queue must not be empty
+static inline key_event_t kq_peek(const key_queue_t *q) {
+  return q->ev[q->tail & (KEY_QUEUE_SIZE - 1)];
+}
+
+static inline void kq_drop(key_queue_t *q) {
+  //Slot is read before producer can reuse it
+  __dmb();
+  q->tail++;
+}
+
+//Consumer side, drops everything queued so far
+static inline void kq_clear(key_queue_t *q) {
+  q->tail = q->head;
+}
+
+//Counts since previous call, for one reader on any core
+//Producer counters are only read, high restarts on the next put
+static inline kq_stats_t kq_stats(key_queue_t *q) {
+  kq_stats_t s;
+  s.high = (q->high_seen == q->high_epoch) ? q->high : kq_count(q);
+  s.drops = q->drops - q->drops_seen;
+  s.lost = q->lost - q->lost_seen;
+  q->drops_seen += s.drops;
+  q->lost_seen += s.lost;
+  q->high_epoch++;
+  return s;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+//Keyboard output backends
+//One is built in, set with BOOK_KBD_OUTPUT in CMake or OUTPUT below
+//Everything is static inline and resolved at compile time, no calls through pointers
+
+#define OUT_BUS      0  //Book8088 bus, timed INT pulse
+#define OUT_BUS_ACK  1  //Book8088 bus, INT dropped on ack_pin
+#define OUT_XT       2  //IBM PC/XT serial keyboard
+#define OUT_PS2      3  //AT/PS2 keyboard with host commands
+#define OUT_SIM      4  //No bus, codes are only timed and logged
+
+#ifndef OUTPUT
+#define OUTPUT OUT_BUS
+#endif
+
+//Capabilities, OUT_CAPS of the backend
+//Codes go to PIO TX FIFO as OUT_WORDS words, bulk stream goes by DMA
+#define OUT_CAP_PIO  0x01
+//Consumer acks bytes, bus can be free long before the frame ends
+#define OUT_CAP_ACK  0x02
+//Bit timing is fixed and host paces us, pulse and gap are not used
+#define OUT_CAP_HOST_PACED 0x04
+//Host sends commands and sets keyboard leds itself
+#define OUT_CAP_HOST_CMD 0x08
+
+//Every backend defines OUT_NAME, OUT_CAPS, OUT_WORDS, OUT_EDGE_WORDS and these:
+//OUT_EDGE_WORDS - FIFO words per out_edge() call, the edge code is timed to
+
+//Claim SM and pins, start output
+static inline void out_init(void);
+//Code to PIO FIFO words, returns word count, up to OUT_WORDS
+//pulse_us is ACK timeout for OUT_CAP_ACK
+static inline uint out_encode(uint32_t *w, uint8_t code, uint32_t pulse_us, uint32_t gap_us);
+//Queue one code, only called when out_idle()
+static inline void out_emit(uint8_t code, uint32_t pulse_us, uint32_t gap_us);
+//Previous code is taken, next one won't wait
+static inline bool out_idle(void);
+//Drop everything queued, lines back to idle, interrupts must be off
+static inline void out_reset(void);
+//Whole code on the wire and how often to check for the next slot
+static inline int64_t out_frame_us(uint32_t gap_us);
+static inline int64_t out_poll_us(uint32_t gap_us);
+//Worst pick to edge with current timing, DL_EMIT budget
+static inline uint32_t out_emit_budget_us(void);
+//Host wants our codes, false while it disabled us
+static inline bool out_enabled(void);
+//Push backend's own bytes, host command replies, true while some still wait
+//Codes and bulk hold off until it is false
+static inline bool out_replies(void);
+//Everything queued before out_drain_start() is out
+static inline void out_drain_start(void);
+static inline bool out_drained(void);
+//Main loop work, host commands and such
+static inline void out_task(void);
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+/*
+Run to completion task loop, one table per core.
+Task runs when its ready() returns true, when period_us is due,
+or on every pass if it has neither. Table order is priority,
+each pass goes top down and nothing is preempted.
+Every run is timed, longer than budget_us counts as overrun.
+Hardware alarms and IRQs stay outside, tasks are main loop work.
+Run times are stat_t, see stats.h, report may come from other core.
+*/
+
+typedef struct {
+  const char *name;
+  void (*run)(void);
+  bool (*ready)(void);
+  uint32_t period_us;
+  uint32_t budget_us;
+  //Next due time of periodic task
+  uint32_t next_us;
+  //Run time, overruns are misses
+  stat_t stat;
+} task_t;
+
+typedef struct {
+  const char *name;
+  task_t *tasks;
+  uint count;
+} sched_t;
+
+#define SCHED(n, t) {.name = n, .tasks = t, .count = sizeof(t)/sizeof(t[0])}
+
+static inline void sched_init(sched_t *s) {
+  uint32_t now = time_us_32();
+  for (uint i = 0; i < s->count; i++) s->tasks[i].next_us = now;
+}
+
+static inline bool task_periodic_due(const task_t *t, uint32_t now) {
+  return t->period_us && (int32_t)(now - t->next_us) >= 0;
+}
+
+static inline bool task_due(const task_t *t, uint32_t now) {
+  if (!t->ready && !t->period_us) return true;
+  return (t->ready && t->ready()) || task_periodic_due(t, now);
+}
+
+//One pass over the table
+static inline void sched_pass(sched_t *s) {
+  for (uint i = 0; i < s->count; i++) {
+    task_t *t = &s->tasks[i];
+    uint32_t start = time_us_32();
+    if (!task_due(t, start)) continue;
+    if (t->period_us) t->next_us = start + t->period_us;
+    t->run();
+    uint32_t took = time_us_32() - start;
+    stat_note(&t->stat, took, t->budget_us && took > t->budget_us);
+  }
+}
+
+//Nothing is triggered, core may sleep until IRQ, SEV or next period
+//Every pass tasks don't keep core awake, they run on next wakeup
+//Returns false if something is due and core didn't sleep
+static inline bool sched_sleep(sched_t *s) {
+  uint32_t now = time_us_32();
+  int32_t wait = INT32_MAX;
+  for (uint i = 0; i < s->count; i++) {
+    task_t *t = &s->tasks[i];
+    if (t->ready && t->ready()) return false;
+    if (!t->period_us) continue;
+    int32_t left = (int32_t)(t->next_us - now);
+    if (left <= 0) return false;
+    if (left < wait) wait = left;
+  }
+  //Timeout needs alarm pool of this core
+  if (wait == INT32_MAX) __wfe();
+  else best_effort_wfe_or_timeout(make_timeout_time_us(wait));
+  return true;
+}
+
+//Since last sched_report, may run on other core, task stats are only read
+static inline void sched_report(sched_t *s) {
+  printf("Tasks %s:\r\n", s->name);
+  for (uint i = 0; i < s->count; i++) {
+    task_t *t = &s->tasks[i];
+    stat_snap_t r = stat_take(&t->stat);
+    printf("  %s: %lu runs, avg %lu us, max %lu us, budget %lu us, overruns %lu\r\n", t->name,
+           (unsigned long)r.count, (unsigned long)(r.count ? r.sum / r.count : 0),
+           (unsigned long)r.worst, (unsigned long)t->budget_us, (unsigned long)r.misses);
+  }
+}
+
+#endif
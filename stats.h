@@ -0,0 +1,72 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+/*
+Timing stats noted on one core, reported from any core.
+Same split as kq_stats(): nobody writes the other side's fields.
+Count, sum and misses only grow, reader takes what changed since
+it looked last. Worst value has a slot per epoch, reader moves on
+to the next epoch and takes the finished slot, waiting out a note
+that is half way through.
+Notes come from one context, reader must not preempt it.
+*/
+
+typedef struct {
+  //Producer only
+  volatile uint32_t count;
+  volatile uint32_t sum;
+  volatile uint32_t misses;
+  volatile uint32_t worst[2];
+  volatile uint32_t busy;   //odd while stat_note runs
+  uint8_t slot;
+  //Reader only, see stat_take()
+  volatile uint8_t epoch;
+  uint32_t count_seen;
+  uint32_t sum_seen;
+  uint32_t misses_seen;
+} stat_t;
+
+typedef struct {
+  uint32_t count;
+  uint32_t sum;
+  uint32_t worst;
+  uint32_t misses;
+} stat_snap_t;
+
+static inline void stat_note(stat_t *s, uint32_t v, bool miss) {
+  s->busy++;
+  __dmb();
+  uint8_t i = s->epoch & 1;
+  //Reader took the other slot, it starts over
+  if (i != s->slot) {
+    s->slot = i;
+    s->worst[i] = 0;
+  }
+  if (v > s->worst[i]) s->worst[i] = v;
+  s->sum += v;
+  if (miss) s->misses++;
+  s->count++;
+  __dmb();
+  s->busy++;
+}
+
+//Since previous stat_take
+static inline stat_snap_t stat_take(stat_t *s) {
+  stat_snap_t r;
+  uint8_t e = s->epoch;
+  s->epoch = e + 1;
+  __dmb();
+  while (s->busy & 1) tight_loop_contents();
+  __dmb();
+  r.worst = s->worst[e & 1];
+  uint32_t count = s->count, sum = s->sum, misses = s->misses;
+  r.count = count - s->count_seen;
+  r.sum = sum - s->sum_seen;
+  r.misses = misses - s->misses_seen;
+  s->count_seen = count;
+  s->sum_seen = sum;
+  s->misses_seen = misses;
+  return r;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef _TIMING_H_
+#define _TIMING_H_
+
+/*
+Bus timing profiles, all values in microseconds.
+
+Native keyboard, measured with BookKbdLog.txt:
+6'100us - interrupt time
+620'700us - fist key repeat
+61'500us - next key repeat
+
+Profile is selected at boot with TIMING_PROFILE
+or at runtime with RCtrl+RAlt+1..9
+
+Gap shrinks down to min_gap_us while there is backlog,
+see pace_update() in book_kbd.c
+*/
+
+typedef struct {
+  const char *name;
+  uint32_t setup_us;   //data valid before INT rises
+  uint32_t pulse_us;   //INT high
+  uint32_t gap_us;     //INT low before next byte
+  uint32_t min_gap_us; //pacing floor for gap_us under backlog
+  uint32_t ack_gap_us; //INT low before next byte after ACK, ACK_HANDSHAKE only
+  uint32_t first_us;   //typematic delay
+  uint32_t next_us;    //typematic rate
+  uint32_t scan_us;    //built-in keyboard sampling
+} timing_profile_t;
+
+const timing_profile_t timing_profiles[] = {
+//  name                 setup  pulse  gap    min_gap ack_gap first   next   scan
+  { "Conservative",      10,    20000, 20000, 5000,   200,    600000, 80000, 4000 },
+  { "Native Book8088",   10,    6100,  6100,  3000,   100,    620700, 61500, 6000 },
+  { "Fast GLaBIOS",      5,     1000,  1000,  500,    20,     500000, 33000, 2000 },
+};
+
+#define TIMING_PROFILES (sizeof(timing_profiles)/sizeof(timing_profiles[0]))
+
+//Boot profile, can be set from CMake
+#ifndef TIMING_PROFILE
+#define TIMING_PROFILE 0
+#endif
+
+//Minimal time between two bytes, gap is set by pacing
+static inline uint32_t timing_frame(const timing_profile_t *t, uint32_t gap_us) {
+  return t->setup_us + t->pulse_us + gap_us;
+}
+
+//Same with ACK, used to poll bus when INT may end early
+static inline uint32_t timing_ack_frame(const timing_profile_t *t) {
+  return t->setup_us + t->ack_gap_us;
+}
+
+#endif
@@ -68,7 +68,7 @@ uint8_t HID2XT[] = {
 0x43,	//F9
 0x44,	//F10
 0,      //F11 - use for mute?
-0,      //F12 - use for turbo?
+0,      //F12 - turbo, see TURBO_KEY
 0x54,	//SysRq (PrtScr)
 0x46,	//ScrollLock
 0,      //Pause
@@ -106,3 +106,228 @@ uint8_t CTRL = 0x1D;
 uint8_t ALT  = 0x38;
 uint8_t SHIFTL = 0x2A;
 uint8_t SHIFTR = 0x36;
+
+//ASCII to XT make code, 0x80 - needs Shift, 0 - not typed
+uint8_t ASCII2XT[128] = {
+0,
+0,
+0,
+0,
+0,
+0,
+0,
+0,
+0x0E,	//Backspace
+0x0F,	//Tab
+0x1C,	//LF
+0,
+0,
+0x1C,	//CR
+0,
+0,
+0,
+0,
+0,
+0,
+0,
+0,
+0,
+0,
+0,
+0,
+0,
+0x01,	//Escape
+0,
+0,
+0,
+0,
+0x39,	//Space
+0x82,	//!
+0xA8,	//"
+0x84,	//#
+0x85,	//$
+0x86,	//%
+0x88,	//&
+0x28,	//'
+0x8A,	//(
+0x8B,	//)
+0x89,	//*
+0x8D,	//+
+0x33,	//,
+0x0C,	//-
+0x34,	//.
+0x35,	///
+0x0B,	//0
+0x02,	//1
+0x03,	//2
+0x04,	//3
+0x05,	//4
+0x06,	//5
+0x07,	//6
+0x08,	//7
+0x09,	//8
+0x0A,	//9
+0xA7,	//:
+0x27,	//;
+0xB3,	//<
+0x0D,	//=
+0xB4,	//>
+0xB5,	//?
+0x83,	//@
+0x9E,	//A
+0xB0,	//B
+0xAE,	//C
+0xA0,	//D
+0x92,	//E
+0xA1,	//F
+0xA2,	//G
+0xA3,	//H
+0x97,	//I
+0xA4,	//J
+0xA5,	//K
+0xA6,	//L
+0xB2,	//M
+0xB1,	//N
+0x98,	//O
+0x99,	//P
+0x90,	//Q
+0x93,	//R
+0x9F,	//S
+0x94,	//T
+0x96,	//U
+0xAF,	//V
+0x91,	//W
+0xAD,	//X
+0x95,	//Y
+0xAC,	//Z
+0x1A,	//[
+0x2B,	//Backslash
+0x1B,	//]
+0x87,	//^
+0x8C,	//_
+0x29,	//`
+0x1E,	//a
+0x30,	//b
+0x2E,	//c
+0x20,	//d
+0x12,	//e
+0x21,	//f
+0x22,	//g
+0x23,	//h
+0x17,	//i
+0x24,	//j
+0x25,	//k
+0x26,	//l
+0x32,	//m
+0x31,	//n
+0x18,	//o
+0x19,	//p
+0x10,	//q
+0x13,	//r
+0x1F,	//s
+0x14,	//t
+0x16,	//u
+0x2F,	//v
+0x11,	//w
+0x2D,	//x
+0x15,	//y
+0x2C,	//z
+0x9A,	//{
+0xAB,	//|
+0x9B,	//}
+0xA9,	//~
+0
+};
+
+//XT make code to AT scancode set 2 make code, break is F0 + make
+uint8_t XT2SET2[0x59] = {
+0x00,
+0x76,	//Esc
+0x16,	//1
+0x1E,	//2
+0x26,	//3
+0x25,	//4
+0x2E,	//5
+0x36,	//6
+0x3D,	//7
+0x3E,	//8
+0x46,	//9
+0x45,	//0
+0x4E,
+0x55,	//=
+0x66,	//Backspace
+0x0D,	//Tab
+0x15,	//Q
+0x1D,	//W
+0x24,	//E
+0x2D,	//R
+0x2C,	//T
+0x35,	//Y
+0x3C,	//U
+0x43,	//I
+0x44,	//O
+0x4D,	//P
+0x54,	//[
+0x5B,	//]
+0x5A,	//Enter
+0x14,	//Ctrl
+0x1C,	//A
+0x1B,	//S
+0x23,	//D
+0x2B,	//F
+0x34,	//G
+0x33,	//H
+0x3B,	//J
+0x42,	//K
+0x4B,	//L
+0x4C,	//;
+0x52,	//'
+0x0E,	//`
+0x12,	//Left Shift
+0x5D,	//Backslash
+0x1A,	//Z
+0x22,	//X
+0x21,	//C
+0x2A,	//V
+0x32,	//B
+0x31,	//N
+0x3A,	//M
+0x41,	//,
+0x49,	//.
+0x4A,	///
+0x59,	//Right Shift
+0x7C,	//KP *
+0x11,	//Alt
+0x29,	//Space
+0x58,	//CapsLock
+0x05,	//F1
+0x06,	//F2
+0x04,	//F3
+0x0C,	//F4
+0x03,	//F5
+0x0B,	//F6
+0x83,	//F7
+0x0A,	//F8
+0x01,	//F9
+0x09,	//F10
+0x77,	//NumLock
+0x7E,	//ScrollLock
+0x6C,	//KP 7
+0x75,	//KP 8
+0x7D,	//KP 9
+0x7B,	//KP -
+0x6B,	//KP 4
+0x73,	//KP 5
+0x74,	//KP 6
+0x79,	//KP +
+0x69,	//KP 1
+0x72,	//KP 2
+0x7A,	//KP 3
+0x70,	//KP 0
+0x71,	//KP Dot
+0x84,	//SysRq
+0x00,
+0x61,	//102nd key
+0x78,	//F11
+0x07	//F12
+};